@@ -0,0 +1,66 @@
+// Syscalls per frame on the server -> client path. A writer queues ack +
+// snapshot frames and flushes every `batch` frames while a reader thread
+// drains the other end of a socketpair. Batch 1 is the old behaviour of one
+// write per message, batch 2 what broadcast() does for a single update.
+#include "csapp.h"
+#include "game.h"
+#include "frame.h"
+
+#define FRAMES 200000
+
+static void *drain(void *vargp)
+{
+    int fd = *(int *) vargp;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const int batches[] = {1, 2, 4, 8, 16, 32};
+    GameState game;
+    char snapshot[SNAPSHOT_MAXLEN + 1];
+
+    initGame(&game, 1);
+    int n = encodeSnapshot(&game, snapshot);
+
+    printf("%6s %14s %10s %10s\n", "batch", "syscalls/frame", "ns/frame", "MB/s");
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        int sv[2];
+        pthread_t tid;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            unix_error("socketpair error");
+        Pthread_create(&tid, NULL, drain, &sv[1]);
+
+        FrameQueue q;
+        initFrameQueue(&q, sv[0]);
+        unsigned char ack[8] = {0}; // last command, tick: what queueAck sends
+        double start = now();
+        for (int i = 0; i < FRAMES; i++) {
+            if (i % 2 == 0)
+                queueFrame(&q, FRAME_ACK, ack, sizeof(ack));
+            else
+                queueFrameRef(&q, FRAME_SNAPSHOT, snapshot, n);
+            if ((i + 1) % batches[b] == 0)
+                flushFrames(&q);
+        }
+        flushFrames(&q);
+        double elapsed = now() - start;
+
+        Close(sv[0]);
+        pthread_join(tid, NULL);
+        Close(sv[1]);
+        printf("%6d %14.3f %10.1f %10.1f\n", batches[b], (double) q.syscalls / q.frames,
+               elapsed * 1e9 / q.frames, (FRAMES / 2) * (n + sizeof(ack) + 2 * FRAME_HEADER) / elapsed / 1e6);
+    }
+    return 0;
+}
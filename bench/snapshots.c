@@ -0,0 +1,179 @@
+// Bytes per snapshot and the time to encode and decode one, for the text
+// snapshot and delta, the text through the general-purpose LZ codec, and the
+// packed ones (common/pack.h), across grids from empty to mostly tomatoes.
+// Deltas are from one tick to the next with every player taking a step.
+#include "csapp.h"
+#include "game.h"
+#include "lz.h"
+#include "pack.h"
+
+#define STATES 1024
+#define ROUNDS 50
+
+typedef enum
+{
+    CODEC_TEXT,
+    CODEC_TEXT_LZ,
+    CODEC_PACKED,
+    CODEC_PACKED_LZ,
+    CODEC_DELTA_TEXT,
+    CODEC_DELTA_PACKED,
+    CODECS
+} CODEC;
+
+static const char *codecNames[CODECS] = {"text", "text+lz", "packed", "packed+lz", "delta text", "delta packed"};
+
+static GameState bases[STATES], states[STATES];
+// what the server keeps of each in its history, to make text deltas from
+static char baseTexts[STATES][SNAPSHOT_MAXLEN + 1], stateTexts[STATES][SNAPSHOT_MAXLEN + 1];
+static int baseLens[STATES], stateLens[STATES];
+static volatile int sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A grid with about percent of its free cells holding tomatoes, four players
+// on it, and the same a tick later
+static void makeStates(int percent, unsigned seed)
+{
+    for (int s = 0; s < STATES; s++) {
+        GameState *game = &bases[s];
+        initGame(game, seed + s);
+        game->score = rand_r(&seed) % 500;
+        game->numTomatoes = 0;
+        for (int x = 0; x < GRIDSIZE; x++) {
+            for (int y = 0; y < GRIDSIZE; y++) {
+                bool tomato = (int) (rand_r(&seed) % 100) < percent;
+                game->grid[x][y] = tomato ? TILE_TOMATO : TILE_GRASS;
+                game->numTomatoes += tomato;
+            }
+        }
+        for (int i = 0; i < MAX_PLAYERS; i++)
+            spawnPlayer(game, i);
+        states[s] = *game;
+        for (int i = 0; i < MAX_PLAYERS; i++)
+            movePlayer(&states[s], i, DIR_UP + rand_r(&seed) % 4);
+        baseLens[s] = encodeSnapshot(&bases[s], baseTexts[s]);
+        stateLens[s] = encodeSnapshot(&states[s], stateTexts[s]);
+    }
+}
+
+static int encode(CODEC codec, int s, unsigned char *out)
+{
+    char text[SNAPSHOT_MAXLEN + 1];
+    int n;
+    switch (codec) {
+    case CODEC_TEXT:
+        return encodeSnapshot(&states[s], (char *) out);
+    case CODEC_TEXT_LZ:
+        n = encodeSnapshot(&states[s], text);
+        return lzCompress((unsigned char *) text, n, out, SNAPSHOT_MAXLEN + 1);
+    case CODEC_PACKED:
+        return packSnapshot(&states[s], NULL, false, out);
+    case CODEC_PACKED_LZ:
+        return packSnapshot(&states[s], NULL, true, out);
+    case CODEC_DELTA_TEXT:
+        n = encodeDelta(baseTexts[s], stateTexts[s], stateLens[s], (char *) out);
+        if (n < 0) {
+            memcpy(out, stateTexts[s], stateLens[s]);
+            n = stateLens[s];
+        }
+        return n;
+    case CODEC_DELTA_PACKED:
+        return packSnapshot(&states[s], &bases[s], false, out);
+    default:
+        return -1;
+    }
+}
+
+static bool decode(CODEC codec, int s, const unsigned char *buf, int len, GameState *game)
+{
+    char text[SNAPSHOT_MAXLEN + 1];
+    int n;
+    switch (codec) {
+    case CODEC_TEXT:
+        return decodeSnapshot((const char *) buf, len, game);
+    case CODEC_TEXT_LZ:
+        n = lzDecompress(buf, len, (unsigned char *) text, sizeof(text));
+        return n >= 0 && decodeSnapshot(text, n, game);
+    case CODEC_PACKED:
+    case CODEC_PACKED_LZ:
+        return unpackSnapshot(buf, len, NULL, game);
+    case CODEC_DELTA_TEXT:
+        memcpy(text, baseTexts[s], baseLens[s]);
+        n = applyDelta(text, (const char *) buf, len);
+        return n >= 0 && decodeSnapshot(text, n, game);
+    case CODEC_DELTA_PACKED:
+        return unpackSnapshot(buf, len, &bases[s], game);
+    default:
+        return false;
+    }
+}
+
+// What every codec must carry, the tomato count being derived from the grid
+static bool sameState(const GameState *a, const GameState *b)
+{
+    if (a->score != b->score || a->level != b->level || a->seed != b->seed)
+        return false;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (a->playerPosition[i].x != b->playerPosition[i].x || a->playerPosition[i].y != b->playerPosition[i].y)
+            return false;
+    }
+    return memcmp(a->grid, b->grid, sizeof(a->grid)) == 0;
+}
+
+int main(void)
+{
+    static const int densities[] = {0, 2, 5, 10, 25, 50, 90};
+    static unsigned char encoded[STATES][SNAPSHOT_MAXLEN + PACK_MAXLEN];
+    static int lens[STATES];
+
+    printf("%8s %-13s %7s %6s %10s %10s\n", "tomatoes", "codec", "bytes", "ratio", "encode ns", "decode ns");
+    for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+        makeStates(densities[d], 1);
+        double textBytes = 0;
+        for (CODEC c = 0; c < CODECS; c++) {
+            double start = now();
+            for (int r = 0; r < ROUNDS; r++) {
+                for (int s = 0; s < STATES; s++)
+                    lens[s] = encode(c, s, encoded[s]);
+            }
+            double encodeTime = now() - start;
+
+            long bytes = 0;
+            GameState game;
+            for (int s = 0; s < STATES; s++) {
+                bytes += lens[s];
+                if (!decode(c, s, encoded[s], lens[s], &game)) {
+                    fprintf(stderr, "%s: state %d does not decode\n", codecNames[c], s);
+                    return 1;
+                }
+                if (!sameState(&game, &states[s])) {
+                    fprintf(stderr, "%s: state %d decodes to a different state\n", codecNames[c], s);
+                    return 1;
+                }
+            }
+            start = now();
+            for (int r = 0; r < ROUNDS; r++) {
+                for (int s = 0; s < STATES; s++)
+                    sink += decode(c, s, encoded[s], lens[s], &game);
+            }
+            double decodeTime = now() - start;
+
+            double avg = (double) bytes / STATES;
+            if (c == CODEC_TEXT) {
+                textBytes = avg;
+                printf("%7d%% ", densities[d]);
+            }
+            else
+                printf("%8s ", "");
+            printf("%-13s %7.1f %6.2f %10.1f %10.1f\n", codecNames[c], avg, textBytes / avg,
+                   encodeTime * 1e9 / ROUNDS / STATES, decodeTime * 1e9 / ROUNDS / STATES);
+        }
+    }
+    return 0;
+}
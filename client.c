@@ -1,286 +1,190 @@
-#include <stdio.h>
-#include <stdbool.h>
-#include <time.h>
+#include <poll.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <ctype.h>
-#include <setjmp.h>
-#include <signal.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <math.h>
-#include <pthread.h>
-#include <semaphore.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-#define	MAXLINE	 8192  /* Max text line length */
-#define RIO_BUFSIZE 8192
-
-// Dimensions for the drawn grid (should be GRIDSIZE * texture dimensions)
-#define GRID_DRAW_WIDTH 640
-#define GRID_DRAW_HEIGHT 640
-
-#define WINDOW_WIDTH GRID_DRAW_WIDTH
-#define WINDOW_HEIGHT (HEADER_HEIGHT + GRID_DRAW_HEIGHT)
+#include "csapp.h"
+#include "game.h"
+#include "frame.h"
+#include "impair.h"
+#include "pack.h"
 
-// Header displays current score
-#define HEADER_HEIGHT 50
-
-// Number of cells vertically/horizontally in the grid
-#define GRIDSIZE 10
-
-typedef struct {
-    int rio_fd;                /* Descriptor for this internal buf */
-    int rio_cnt;               /* Unread bytes in internal buf */
-    char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
-} rio_t;
-
-void unix_error(char *msg) /* Unix-style error */
-{
-    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
-    exit(0);
-}
+// Size in pixels of one sprite in the texture atlas
+#define TILE_SIZE 64
 
-void app_error(char *msg) /* Application error */
-{
-    fprintf(stderr, "%s\n", msg);
-    exit(0);
-}
+// Initial window size; the world may be larger, the camera shows part of it
+#define WINDOW_WIDTH 640
+#define WINDOW_HEIGHT (HEADER_HEIGHT + 640)
 
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
+// Below this many pixels per cell tiles are drawn as flat colours
+#define LOD_TILE_SIZE 16
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;          
-    if (rp->rio_cnt < n)   
-	cnt = rp->rio_cnt;
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
-}
-
-void rio_readinitb(rio_t *rp, int fd) 
-{
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
-}
-
-void Rio_readinitb(rio_t *rp, int fd)
-{
-    rio_readinitb(rp, fd);
-}
-
-char *Fgets(char *ptr, int n, FILE *stream) 
-{
-    char *rptr;
-
-    if (((rptr = fgets(ptr, n, stream)) == NULL) && ferror(stream))
-	app_error("Fgets error");
-
-    return rptr;
-}
-
-void Fputs(const char *ptr, FILE *stream) 
-{
-    if (fputs(ptr, stream) == EOF)
-	unix_error("Fputs error");
-}
-
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
-{
-    int n, rc;
-    char c, *bufp = usrbuf;
+// Header displays current score
+#define HEADER_HEIGHT 50
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
-    }
-    *bufp = 0;
-    return n-1;
-}
+// ACTUAL GAME CODE
 
-ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
+// What is on screen: the last snapshot with our unacknowledged moves applied
+GameState state;
+int localPlayer = -1; // index of this client's player, sent by the server
+
+// Render invalidation, written by the network thread and consumed by the
+// render loop under mutex.
+// cellDirty: tiles that changed since they were last drawn into the background layer
+// backgroundDirty: the whole background layer must be redrawn
+// frameDirty: something visible changed since the last present
+bool cellDirty[GRIDSIZE][GRIDSIZE];
+bool backgroundDirty = true;
+bool frameDirty = true;
+sem_t mutex;
+
+// Moves sent to the server but not yet acknowledged by a snapshot. They are
+// applied locally as soon as they are sent and re-applied on top of every
+// snapshot until the server reports having processed them.
+typedef struct
 {
-    ssize_t rc;
-
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0)
-	unix_error("Rio_readlineb error");
-    return rc;
-} 
-
-void Close(int fd) 
+    unsigned seq;
+    int input;     // 1-4 as returned by handleKeyDown
+} PendingInput;
+
+#define MAX_PENDING 64
+PendingInput pending[MAX_PENDING];
+int pendingCount;
+unsigned inputSeq;
+unsigned movesRefused; // key presses ignored while MAX_PENDING moves were waiting
+
+// Where the other players were, and when we heard about it. They are drawn
+// interpDelay ms in the past so there is always a next position to move towards,
+// independently of how often snapshots arrive.
+typedef struct
 {
-    int rc;
-
-    if ((rc = close(fd)) < 0)
-	unix_error("Close error");
-}
+    Uint32 time;   // SDL_GetTicks() when the snapshot arrived
+    Position pos;
+} Keyframe;
 
-int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+#define MAX_KEYFRAMES 16
+Keyframe keyframes[MAX_PLAYERS][MAX_KEYFRAMES]; // per player, oldest first
+int keyframeCount[MAX_PLAYERS];
+int interpDelay = 100;
 
-    /* Get a list of potential server addresses */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
-    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
-    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
-        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
-        return -2;
-    }
-  
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
-
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
-
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
-        return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
-}
+bool shouldExit = false;
 
-int Open_clientfd(char *hostname, char *port) 
+// A dropped connection is reopened within the server's grace period and
+// resumes our player with the token from the welcome frame, or watches again.
+// The new socket replaces the old one under the same fd, with sendMutex held
+// so no send is cut in two.
+int serverfd;
+sem_t sendMutex;
+char *serverHost, *serverPort;
+uint64_t resumeToken; // 0 until welcomed
+#define RESUME_WINDOW 10000 // ms, the server's RESUME_GRACE
+int watchedRoom = -1; // -W: a viewer of that room, with no player of our own
+
+// Recent snapshots by tick, which delta frames are applied to. With -u they
+// arrive out of order and some not at all; any older than the newest one
+// applied is dropped.
+#define SNAPSHOT_RING 16
+typedef struct
 {
-    int rc;
-
-    if ((rc = open_clientfd(hostname, port)) < 0) 
-	unix_error("Open_clientfd error");
-    return rc;
-}
-
-ssize_t rio_writen(int fd, void *usrbuf, size_t n) 
+    unsigned tick;
+    bool valid;
+    GameState game;
+} Snapshot;
+Snapshot snapshots[SNAPSHOT_RING];
+unsigned newestTick;
+bool haveSnapshot;
+
+// With -u snapshots and moves go as datagrams on udpfd, once the server has
+// said where to; TCP still carries everything else
+bool useUdp;
+int udpfd = -1;
+#define UDP_INTERVAL 50 // ms between datagrams when no moves are made
+#define UDP_MAXDGRAM 512
+Uint32 lastUdpSend;
+unsigned udpSnapshots;
+Impair impair;
+Impair* impaired; // -I: loss and latency added to our datagrams
+
+// Frame pacing: frames are drawn at most every frameBudget ticks of the
+// performance counter, and not at all while nothing changes.
+// wakeEvent is pushed by the network thread to end an idle wait.
+int targetFps = 60;
+bool vsync = false;
+Uint64 frameBudget;
+Uint32 wakeEvent = (Uint32) -1;
+bool wakePending;
+
+// Headless mode: no window or renderer, moves come from a script of
+// "<ms since start> <command>" lines instead of the keyboard
+typedef struct
 {
-    size_t nleft = n;
-    ssize_t nwritten;
-    char *bufp = usrbuf;
+    Uint32 time;
+    int input;     // as returned by handleKeyDown
+} ScriptedInput;
 
-    while (nleft > 0) {
-	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-	    if (errno == EINTR)  /* Interrupted by sig handler return */
-		nwritten = 0;    /* and call write() again */
-	    else
-		return -1;       /* errno set by write() */
-	}
-	nleft -= nwritten;
-	bufp += nwritten;
-    }
-    return n;
-}
+bool headless = false;
+ScriptedInput* script;
+int scriptLength;
 
-void Rio_writen(int fd, void *usrbuf, size_t n) 
-{
-    if (rio_writen(fd, usrbuf, n) != n)
-	unix_error("Rio_writen error");
-}
+// Time spent turning received snapshots into the displayed state
+Uint64 decodeTicks;
+unsigned snapshotsDecoded;
 
-void posix_error(int code, char *msg) /* Posix-style error */
-{
-    fprintf(stderr, "%s: %s\n", msg, strerror(code));
-    exit(0);
-}
+TTF_Font* font;
 
-void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp, 
-		    void * (*routine)(void *), void *argp) 
+// All sprites live side by side in one texture so that consecutive copies
+// share a texture and SDL can batch them into a single draw call
+typedef enum
 {
-    int rc;
-
-    if ((rc = pthread_create(tidp, attrp, routine, argp)) != 0)
-	posix_error(rc, "Pthread_create error");
-}
-
-void Pthread_detach(pthread_t tid) {
-    int rc;
-
-    if ((rc = pthread_detach(tid)) != 0)
-	posix_error(rc, "Pthread_detach error");
-}
-
-// ACTUAL GAME CODE
-
+    SPRITE_GRASS,
+    SPRITE_TOMATO,
+    SPRITE_PLAYER,
+    SPRITE_COUNT = SPRITE_PLAYER + 4
+} SPRITE;
+
+const char* spriteFiles[SPRITE_COUNT] = {
+    "resources/grass.png",
+    "resources/tomato.png",
+    "resources/player.png",
+    "resources/player2.png",
+    "resources/player3.png",
+    "resources/player4.png"
+};
+
+SDL_Texture* atlas;
+SDL_Rect spriteRect[SPRITE_COUNT];
+
+// Pixels per cell for each zoom level, closest first
+const int zoomLevels[] = { 64, 32, 16, 8, 4 };
+#define ZOOM_LEVELS ((int) (sizeof(zoomLevels) / sizeof(zoomLevels[0])))
+
+// The part of the world shown in the grid area of the window.
+// Only used by the render thread.
 typedef struct
 {
-    int x;
+    int zoom;      // index into zoomLevels
+    int tile;      // pixels per cell at the current zoom
+    SDL_Rect view; // grid area of the window, in screen pixels
+    int x;         // world pixel shown at the top left of the view
     int y;
-} Position;
+} Camera;
 
-typedef enum
-{
-    TILE_GRASS,
-    TILE_TOMATO
-} TILETYPE;
-
-TILETYPE grid[GRIDSIZE][GRIDSIZE];
+Camera camera;
 
-Position playerPosition[4];
-int score;
-int level;
-int numTomatoes;
-
-bool shouldExit = false;
-
-TTF_Font* font;
-
-// get a random value in the range [0, 1]
-double rand01()
+// The cells around the view, pre-drawn so a frame is a single copy.
+// Sized to the view rather than the world so its cost follows the window.
+typedef struct
 {
-    return (double) rand() / (double) RAND_MAX;
-}
+    SDL_Texture* texture;
+    int cols;      // capacity in cells
+    int rows;
+    int tile;      // pixels per cell the layer was drawn at
+    int i0;        // world cell drawn at the top left of the layer
+    int j0;
+} Layer;
+
+Layer background;
 
 void initSDL()
 {
@@ -301,16 +205,59 @@ void initSDL()
     }
 }
 
-int handleKeyDown(SDL_KeyboardEvent* event, int clientfd, rio_t rio)
+// Pack every sprite into a single atlas texture, one TILE_SIZE column each
+SDL_Texture* loadAtlas(SDL_Renderer* renderer)
+{
+    SDL_Surface* sheet = SDL_CreateRGBSurfaceWithFormat(0, TILE_SIZE * SPRITE_COUNT, TILE_SIZE, 32, SDL_PIXELFORMAT_RGBA32);
+    if (sheet == NULL) {
+        fprintf(stderr, "Error creating atlas: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < SPRITE_COUNT; i++) {
+        SDL_Surface* sprite = IMG_Load(spriteFiles[i]);
+        if (sprite == NULL) {
+            fprintf(stderr, "Error loading %s: %s\n", spriteFiles[i], IMG_GetError());
+            exit(EXIT_FAILURE);
+        }
+        spriteRect[i].x = TILE_SIZE * i;
+        spriteRect[i].y = 0;
+        spriteRect[i].w = TILE_SIZE;
+        spriteRect[i].h = TILE_SIZE;
+        // copy alpha as-is instead of blending onto the empty sheet
+        SDL_SetSurfaceBlendMode(sprite, SDL_BLENDMODE_NONE);
+        SDL_Rect dest = spriteRect[i];
+        SDL_BlitScaled(sprite, NULL, sheet, &dest);
+        SDL_FreeSurface(sprite);
+    }
+
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, sheet);
+    SDL_FreeSurface(sheet);
+    if (texture == NULL) {
+        fprintf(stderr, "Error creating atlas texture: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    return texture;
+}
+
+void setZoom(int zoom)
+{
+    if (zoom < 0 || zoom >= ZOOM_LEVELS || zoom == camera.zoom)
+        return;
+    camera.zoom = zoom;
+    P(&mutex);
+    frameDirty = true;
+    V(&mutex);
+}
+
+int handleKeyDown(SDL_KeyboardEvent* event)
 {
     // ignore repeat events if key is held down
     if (event->repeat)
         return 9;
 
     if (event->keysym.scancode == SDL_SCANCODE_Q || event->keysym.scancode == SDL_SCANCODE_ESCAPE){
-	shouldExit = true;
-	char buf[MAXLINE] = "quit\n";
-	Rio_writen(clientfd, buf, strlen(buf));
         return 0;
         }
 
@@ -329,226 +276,966 @@ int handleKeyDown(SDL_KeyboardEvent* event, int clientfd, rio_t rio)
     if (event->keysym.scancode == SDL_SCANCODE_RIGHT || event->keysym.scancode == SDL_SCANCODE_D){
         return 4;
         }
+
+    if (event->keysym.scancode == SDL_SCANCODE_EQUALS || event->keysym.scancode == SDL_SCANCODE_KP_PLUS){
+        setZoom(camera.zoom - 1);
+        return 10;
+        }
+
+    if (event->keysym.scancode == SDL_SCANCODE_MINUS || event->keysym.scancode == SDL_SCANCODE_KP_MINUS){
+        setZoom(camera.zoom + 1);
+        return 10;
+        }
     return 10;
 }
 
-int processInputs(int clientfd, rio_t rio)
+// Commands gathered from every event pending this frame, in the order they
+// happened, sent to the server in a single write
+typedef struct
+{
+    char buf[MAXLINE];
+    size_t len;
+    bool quit;
+} InputBatch;
+
+// Server command for each handleKeyDown result
+const char* commandNames[] = { "quit", "up", "down", "left", "right" };
+
+// Remember a player's position from a snapshot if it moved. Caller holds mutex.
+void addKeyframe(int player, Position pos, Uint32 now)
+{
+    int n = keyframeCount[player];
+    if (n > 0 && keyframes[player][n - 1].pos.x == pos.x && keyframes[player][n - 1].pos.y == pos.y)
+        return;
+    if (n == MAX_KEYFRAMES) {
+        memmove(keyframes[player], keyframes[player] + 1, (MAX_KEYFRAMES - 1) * sizeof(Keyframe));
+        n--;
+    }
+    keyframes[player][n].time = now;
+    keyframes[player][n].pos = pos;
+    keyframeCount[player] = n + 1;
+}
+
+// Position of a player at render time t, in cells. Each step is animated over
+// the time since the previous one, at most interpDelay, and ends at the time
+// it was received; spawns and jumps are not animated. Returns false while the
+// player is still moving at t. Caller holds mutex.
+bool interpolate(int player, Uint32 t, float* x, float* y)
+{
+    Keyframe* k = keyframes[player];
+    int n = keyframeCount[player];
+    *x = k[n - 1].pos.x;
+    *y = k[n - 1].pos.y;
+
+    for (int i = n - 1; i > 0; i--) {
+        if ((Sint32) (t - k[i].time) >= 0) {
+            *x = k[i].pos.x;
+            *y = k[i].pos.y;
+            return true;
+        }
+        Uint32 span = k[i].time - k[i - 1].time;
+        if (span > (Uint32) interpDelay)
+            span = interpDelay;
+        Uint32 start = k[i].time - span;
+        bool jump = k[i - 1].pos.x < 0 || k[i].pos.x < 0 ||
+                    abs(k[i].pos.x - k[i - 1].pos.x) + abs(k[i].pos.y - k[i - 1].pos.y) > 1;
+        if (!jump && span > 0 && (Sint32) (t - start) >= 0) {
+            float f = (float) (t - start) / span;
+            *x = k[i - 1].pos.x + f * (k[i].pos.x - k[i - 1].pos.x);
+            *y = k[i - 1].pos.y + f * (k[i].pos.y - k[i - 1].pos.y);
+            return false;
+        }
+        *x = k[i - 1].pos.x;
+        *y = k[i - 1].pos.y;
+    }
+    return n <= 1;
+}
+
+// Replace the displayed state, invalidating whatever changed. Caller holds mutex.
+void showState(const GameState* next)
+{
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++) {
+            if (state.grid[i][j] != next->grid[i][j]) {
+                cellDirty[i][j] = true;
+                frameDirty = true;
+            }
+        }
+    }
+    if (next->score != state.score || next->level != state.level)
+        frameDirty = true;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (next->playerPosition[i].x != state.playerPosition[i].x || next->playerPosition[i].y != state.playerPosition[i].y)
+            frameDirty = true;
+    }
+    state = *next;
+}
+
+// Number a move, apply it locally straight away and remember it until the
+// server acknowledges it. Returns its sequence number, or 0 if MAX_PENDING
+// moves are already waiting: one we couldn't resend would be lost over UDP.
+unsigned predictInput(int input)
+{
+    unsigned seq = 0;
+    P(&mutex);
+    if (localPlayer < 0)
+        seq = ++inputSeq;
+    else if (pendingCount < MAX_PENDING) {
+        seq = ++inputSeq;
+        pending[pendingCount].seq = seq;
+        pending[pendingCount].input = input;
+        pendingCount++;
+        GameState next = state;
+        movePlayer(&next, localPlayer, input);
+        showState(&next);
+    }
+    else
+        movesRefused++;
+    V(&mutex);
+    return seq;
+}
+
+// Errors are left to the updater, which sees the connection end and resumes;
+// pending moves are sent again then
+void sendToServer(const char* buf, size_t len)
+{
+    P(&sendMutex);
+    rio_writen(serverfd, (void*) buf, len);
+    V(&sendMutex);
+}
+
+void sendMoves();
+
+// Moves go as datagrams once the server has told us where to, anything else
+// over TCP
+void sendBatch(InputBatch* batch)
+{
+    if (udpfd >= 0) {
+        sendMoves();
+        if (batch->quit)
+            sendToServer("quit\n", 5);
+    }
+    else
+        sendToServer(batch->buf, batch->len);
+    batch->len = 0;
+}
+
+void addInput(InputBatch* batch, int input)
+{
+    // nothing after a quit matters, and any other result is not a command
+    if (batch->quit || input < 0 || input > 4)
+        return;
+
+    // leave room for the longest command and its sequence number
+    if (batch->len + 32 > sizeof(batch->buf)) {
+        sendBatch(batch);
+    }
+    if (input == 0) {
+        batch->len += sprintf(batch->buf + batch->len, "%s\n", commandNames[input]);
+        batch->quit = true;
+        shouldExit = true;
+        return;
+    }
+
+    // moves are numbered so snapshots can say which ones they already include
+    unsigned seq = predictInput(input);
+    if (seq != 0)
+        batch->len += sprintf(batch->buf + batch->len, "%s %u\n", commandNames[input], seq);
+}
+
+// Drain every pending event, so a key press never waits behind unrelated
+// events for a later frame
+void processInputs(InputBatch* batch)
 {
 	SDL_Event event;
+	bool redraw = false;
+	bool reset = false;
 
 	while (SDL_PollEvent(&event)) {
 		switch (event.type) {
 			case SDL_QUIT:
-				shouldExit = true;
-				char buf[MAXLINE] = "quit\n";
-				Rio_writen(clientfd, buf, strlen(buf));
-				return 0;
+				addInput(batch, 0);
+				break;
 
             case SDL_KEYDOWN:
-                return handleKeyDown(&event.key, clientfd, rio);
+                addInput(batch, handleKeyDown(&event.key));
+                break;
+
+            case SDL_MOUSEWHEEL: {
+                // y is positive away from the user, unless the device flips it
+                int y = event.wheel.direction == SDL_MOUSEWHEEL_FLIPPED ? -event.wheel.y : event.wheel.y;
+                // a purely horizontal scroll doesn't zoom
+                if (y != 0)
+                    setZoom(camera.zoom - (y > 0 ? 1 : -1));
+                break;
+            }
+
+            case SDL_WINDOWEVENT:
+                // window was uncovered or resized, the last presented frame is gone
+                redraw = true;
+                break;
+
+            case SDL_RENDER_TARGETS_RESET:
+            case SDL_RENDER_DEVICE_RESET:
+                // contents of the background layer were lost
+                reset = true;
+                break;
 
 			default:
-				return 10;
+				if (event.type == wakeEvent) {
+					P(&mutex);
+					wakePending = false;
+					V(&mutex);
+				}
+				break;
 		}
 	}
-	return 10;
+
+	if (redraw || reset) {
+		P(&mutex);
+		frameDirty = true;
+		if (reset)
+			backgroundDirty = true;
+		V(&mutex);
+	}
 }
 
-void drawGrid(SDL_Renderer* renderer, SDL_Texture* grassTexture, SDL_Texture* tomatoTexture, SDL_Texture** playerTexture)
+// Centre the camera on the local player, keeping the view inside the world
+// when the world is larger than the window. Caller holds mutex.
+void updateCamera(SDL_Renderer* renderer)
 {
-    SDL_Rect dest;
-    for (int i = 0; i < GRIDSIZE; i++) {
-        for (int j = 0; j < GRIDSIZE; j++) {
-            dest.x = 64 * i;
-            dest.y = 64 * j + HEADER_HEIGHT;
-            SDL_Texture* texture = (grid[i][j] == TILE_GRASS) ? grassTexture : tomatoTexture;
-            SDL_QueryTexture(texture, NULL, NULL, &dest.w, &dest.h);
-            SDL_RenderCopy(renderer, texture, NULL, &dest);
+    int w, h;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+    camera.view.x = 0;
+    camera.view.y = HEADER_HEIGHT;
+    camera.view.w = w;
+    camera.view.h = h > HEADER_HEIGHT ? h - HEADER_HEIGHT : 0;
+    camera.tile = zoomLevels[camera.zoom];
+
+    int world = GRIDSIZE * camera.tile;
+    int focusX = world / 2;
+    int focusY = world / 2;
+    if (localPlayer >= 0 && state.playerPosition[localPlayer].x >= 0) {
+        focusX = state.playerPosition[localPlayer].x * camera.tile + camera.tile / 2;
+        focusY = state.playerPosition[localPlayer].y * camera.tile + camera.tile / 2;
+    }
+
+    camera.x = focusX - camera.view.w / 2;
+    if (world <= camera.view.w)
+        camera.x = (world - camera.view.w) / 2;
+    else if (camera.x < 0)
+        camera.x = 0;
+    else if (camera.x > world - camera.view.w)
+        camera.x = world - camera.view.w;
+
+    camera.y = focusY - camera.view.h / 2;
+    if (world <= camera.view.h)
+        camera.y = (world - camera.view.h) / 2;
+    else if (camera.y < 0)
+        camera.y = 0;
+    else if (camera.y > world - camera.view.h)
+        camera.y = world - camera.view.h;
+}
+
+// Bring the background layer up to date for the current camera. Only tiles
+// that changed since the last call are redrawn, unless the view moved to other
+// cells or changed zoom. Caller holds mutex.
+void drawBackground(SDL_Renderer* renderer)
+{
+    int tile = camera.tile;
+    int cols = camera.view.w / tile + 2;
+    int rows = camera.view.h / tile + 2;
+    int i0 = camera.x > 0 ? camera.x / tile : 0;
+    int j0 = camera.y > 0 ? camera.y / tile : 0;
+
+    if (background.texture == NULL || cols > background.cols || rows > background.rows || tile != background.tile) {
+        if (background.texture != NULL)
+            SDL_DestroyTexture(background.texture);
+        background.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, cols * tile, rows * tile);
+        if (background.texture == NULL) {
+            fprintf(stderr, "Error creating background layer: %s\n", SDL_GetError());
+            exit(EXIT_FAILURE);
         }
+        background.cols = cols;
+        background.rows = rows;
+        background.tile = tile;
+        backgroundDirty = true;
+    }
+    if (i0 != background.i0 || j0 != background.j0) {
+        background.i0 = i0;
+        background.j0 = j0;
+        backgroundDirty = true;
     }
 
-for (int i = 0; i < 4; i++) {
-	if (playerPosition[i].x != -1 && playerPosition[i].y != -1) {
-	
-	
-    dest.x = 64 * playerPosition[i].x;
-    dest.y = 64 * playerPosition[i].y + HEADER_HEIGHT;
-    SDL_QueryTexture(playerTexture[i], NULL, NULL, &dest.w, &dest.h);
-    SDL_RenderCopy(renderer, playerTexture[i], NULL, &dest);
-	}
+    SDL_SetRenderTarget(renderer, background.texture);
+    if (backgroundDirty) {
+        SDL_SetRenderDrawColor(renderer, 0, 105, 6, 255);
+        SDL_RenderClear(renderer);
+    }
+
+    int i1 = i0 + background.cols < GRIDSIZE ? i0 + background.cols : GRIDSIZE;
+    int j1 = j0 + background.rows < GRIDSIZE ? j0 + background.rows : GRIDSIZE;
+    SDL_Rect dest = { 0, 0, tile, tile };
+    for (int i = i0; i < i1; i++) {
+        for (int j = j0; j < j1; j++) {
+            if (!backgroundDirty && !cellDirty[i][j])
+                continue;
+            dest.x = tile * (i - i0);
+            dest.y = tile * (j - j0);
+            if (tile < LOD_TILE_SIZE) {
+                if (state.grid[i][j] == TILE_GRASS)
+                    SDL_SetRenderDrawColor(renderer, 72, 160, 48, 255);
+                else
+                    SDL_SetRenderDrawColor(renderer, 200, 30, 30, 255);
+                SDL_RenderFillRect(renderer, &dest);
+            }
+            else {
+                SPRITE sprite = (state.grid[i][j] == TILE_GRASS) ? SPRITE_GRASS : SPRITE_TOMATO;
+                SDL_RenderCopy(renderer, atlas, &spriteRect[sprite], &dest);
+            }
+            cellDirty[i][j] = false;
+        }
+    }
+    backgroundDirty = false;
+    SDL_SetRenderTarget(renderer, NULL);
 }
+
+// Composite the background layer and the visible players into the view.
+// Caller holds mutex.
+void drawGrid(SDL_Renderer* renderer, Uint32 now)
+{
+    int tile = camera.tile;
+    SDL_RenderSetClipRect(renderer, &camera.view);
+
+    SDL_Rect dest;
+    dest.x = camera.view.x + background.i0 * tile - camera.x;
+    dest.y = camera.view.y + background.j0 * tile - camera.y;
+    dest.w = background.cols * tile;
+    dest.h = background.rows * tile;
+    SDL_RenderCopy(renderer, background.texture, NULL, &dest);
+
+    // the local player is shown where prediction put it, the others in the past
+    bool settled = true;
+    dest.w = tile;
+    dest.h = tile;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        float x = state.playerPosition[i].x;
+        float y = state.playerPosition[i].y;
+        if (i != localPlayer && keyframeCount[i] > 0)
+            settled &= interpolate(i, now - interpDelay, &x, &y);
+        if (x < 0 || y < 0)
+            continue;
+        dest.x = camera.view.x + (int) (tile * x) - camera.x;
+        dest.y = camera.view.y + (int) (tile * y) - camera.y;
+        if (dest.x + tile <= camera.view.x || dest.x >= camera.view.x + camera.view.w ||
+            dest.y + tile <= camera.view.y || dest.y >= camera.view.y + camera.view.h)
+            continue;
+        SDL_RenderCopy(renderer, atlas, &spriteRect[SPRITE_PLAYER + i], &dest);
+    }
+
+    SDL_RenderSetClipRect(renderer, NULL);
+
+    // keep drawing frames until everyone has arrived
+    if (!settled)
+        frameDirty = true;
 }
 
-void drawUI(SDL_Renderer* renderer)
+// A HUD label rendered to a texture once and reused until its value changes
+typedef struct
+{
+    const char* label;
+    int value;
+    bool valid;
+    SDL_Texture* texture;
+    int w;
+    int h;
+} TextCache;
+
+TextCache scoreText = { "Score" };
+TextCache levelText = { "Level" };
+
+// Re-rasterize the cached text only if the value differs from the last one drawn
+void updateTextCache(SDL_Renderer* renderer, TextCache* cache, int value)
 {
+    if (cache->valid && cache->value == value)
+        return;
+
     // largest score/level supported is 2147483647
-    char scoreStr[18];
-    char levelStr[18];
-    sprintf(scoreStr, "Score: %d", score);
-    sprintf(levelStr, "Level: %d", level);
+    char str[32];
+    snprintf(str, sizeof(str), "%s: %d", cache->label, value);
 
     SDL_Color white = {255, 255, 255};
-    SDL_Surface* scoreSurface = TTF_RenderText_Solid(font, scoreStr, white);
-    SDL_Texture* scoreTexture = SDL_CreateTextureFromSurface(renderer, scoreSurface);
+    SDL_Surface* surface = TTF_RenderText_Solid(font, str, white);
+    if (surface == NULL) {
+        fprintf(stderr, "Error rendering text: %s\n", TTF_GetError());
+        return;
+    }
 
-    SDL_Surface* levelSurface = TTF_RenderText_Solid(font, levelStr, white);
-    SDL_Texture* levelTexture = SDL_CreateTextureFromSurface(renderer, levelSurface);
+    if (cache->texture != NULL)
+        SDL_DestroyTexture(cache->texture);
+    cache->texture = SDL_CreateTextureFromSurface(renderer, surface);
+    cache->w = surface->w;
+    cache->h = surface->h;
+    cache->value = value;
+    cache->valid = true;
 
-    SDL_Rect scoreDest;
-    TTF_SizeText(font, scoreStr, &scoreDest.w, &scoreDest.h);
-    scoreDest.x = 0;
-    scoreDest.y = 0;
+    SDL_FreeSurface(surface);
+}
 
-    SDL_Rect levelDest;
-    TTF_SizeText(font, levelStr, &levelDest.w, &levelDest.h);
-    levelDest.x = GRID_DRAW_WIDTH - levelDest.w;
-    levelDest.y = 0;
+void freeTextCache(TextCache* cache)
+{
+    if (cache->texture != NULL)
+        SDL_DestroyTexture(cache->texture);
+    cache->texture = NULL;
+    cache->valid = false;
+}
 
-    SDL_RenderCopy(renderer, scoreTexture, NULL, &scoreDest);
-    SDL_RenderCopy(renderer, levelTexture, NULL, &levelDest);
+void drawUI(SDL_Renderer* renderer)
+{
+    updateTextCache(renderer, &scoreText, state.score);
+    updateTextCache(renderer, &levelText, state.level);
 
-    SDL_FreeSurface(scoreSurface);
-    SDL_DestroyTexture(scoreTexture);
+    SDL_Rect scoreDest = { 0, 0, scoreText.w, scoreText.h };
+    SDL_Rect levelDest = { camera.view.w - levelText.w, 0, levelText.w, levelText.h };
 
-    SDL_FreeSurface(levelSurface);
-    SDL_DestroyTexture(levelTexture);
+    SDL_RenderCopy(renderer, scoreText.texture, NULL, &scoreDest);
+    SDL_RenderCopy(renderer, levelText.texture, NULL, &levelDest);
 }
 
-void update(int clientfd, rio_t rio, char *buf) {
+// Apply a snapshot or delta sent for tick, unless a newer one already was.
+// ack is the last of our inputs the server had processed then.
+void applyUpdate(FRAMETYPE type, char *buf, ssize_t n, unsigned tick, unsigned ack)
+{
+    Uint64 decodeStart = SDL_GetPerformanceCounter();
+    P(&mutex);
+    if (haveSnapshot && (int) (tick - newestTick) <= 0) {
+        V(&mutex);
+        return;
+    }
 
-	Rio_readlineb(&rio, buf, MAXLINE);
-	int c = 0;
-	for (int i = 0; i < GRIDSIZE; i++) {
-		for (int j = 0; j < GRIDSIZE; j++) {
-			if (buf[c] == 'T') {
-				grid[i][j] = TILE_TOMATO;
-			}
-			else {
-				grid[i][j] = TILE_GRASS;
+    // only good on top of the snapshot it was made from
+    const GameState *base = NULL;
+    if (type == FRAME_DELTA || type == FRAME_PACKED_DELTA) {
+        if (n < 4) {
+            V(&mutex);
+            return;
+        }
+        unsigned char *p = (unsigned char *) buf;
+        unsigned from = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        Snapshot *s = &snapshots[from % SNAPSHOT_RING];
+        if (!s->valid || s->tick != from) {
+            V(&mutex);
+            return;
+        }
+        base = &s->game;
+        buf += 4;
+        n -= 4;
+    }
+
+    // the authoritative state
+    GameState next;
+    bool ok;
+    if (type == FRAME_PACKED || type == FRAME_PACKED_DELTA)
+        ok = unpackSnapshot((unsigned char *) buf, n, base, &next);
+    else {
+        char text[SNAPSHOT_MAXLEN + 1];
+        if (base != NULL) {
+            encodeSnapshot(base, text);
+            n = applyDelta(text, buf, n);
+        }
+        else if (n <= SNAPSHOT_MAXLEN)
+            memcpy(text, buf, n);
+        ok = n >= 0 && n <= SNAPSHOT_MAXLEN && decodeSnapshot(text, n, &next);
+    }
+    if (!ok) {
+        V(&mutex);
+        return;
+    }
+    Snapshot *s = &snapshots[tick % SNAPSHOT_RING];
+    s->tick = tick;
+    s->valid = true;
+    s->game = next;
+    newestTick = tick;
+    haveSnapshot = true;
+
+    Uint32 now = SDL_GetTicks();
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        addKeyframe(i, next.playerPosition[i], now);
+
+    // reconcile: drop acknowledged inputs and replay the rest on top of the snapshot
+    int kept = 0;
+    for (int i = 0; i < pendingCount; i++) {
+        if ((int) (pending[i].seq - ack) > 0)
+            pending[kept++] = pending[i];
+    }
+    pendingCount = kept;
+    for (int i = 0; i < pendingCount; i++)
+        movePlayer(&next, localPlayer, pending[i].input);
+
+    showState(&next);
+    decodeTicks += SDL_GetPerformanceCounter() - decodeStart;
+    snapshotsDecoded++;
+
+    // the render loop may be idle waiting for events, wake it up
+    if (frameDirty && !wakePending && wakeEvent != (Uint32) -1) {
+        SDL_Event wake;
+        SDL_zero(wake);
+        wake.type = wakeEvent;
+        wakePending = true;
+        SDL_PushEvent(&wake);
+    }
+    V(&mutex);
+}
+
+// Our unacknowledged moves, all of them every time so a lost datagram is
+// made up for by the next, and the newest tick we have, which the server
+// makes deltas from. See readable() in the server for the layout.
+void sendMoves()
+{
+    unsigned char dgram[UDP_MAXDGRAM];
+    P(&mutex);
+    for (int i = 0; i < 8; i++)
+        dgram[i] = resumeToken >> (56 - 8 * i);
+    unsigned first = pendingCount > 0 ? pending[0].seq : inputSeq + 1;
+    unsigned fields[2] = {newestTick, first};
+    for (int i = 0; i < 8; i++)
+        dgram[8 + i] = fields[i / 4] >> (24 - 8 * (i % 4));
+    int count = 0;
+    while (count < pendingCount && pending[count].seq == first + count) {
+        dgram[17 + count] = pending[count].input;
+        count++;
+    }
+    dgram[16] = count;
+    lastUdpSend = SDL_GetTicks();
+    V(&mutex);
+    impairSend(impaired, udpfd, dgram, 17 + count, NULL, 0);
+}
+
+// Sends moves every UDP_INTERVAL ms, whether there are new ones or not, and
+// applies the snapshots that come back
+void *udpTransport(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    char buf[UDP_MAXDGRAM];
+    while (!shouldExit) {
+        int wait = UDP_INTERVAL - (int) (SDL_GetTicks() - lastUdpSend);
+        int held = impairFlush(impaired);
+        if (held >= 0 && held < wait)
+            wait = held;
+        struct pollfd pfd = {.fd = udpfd, .events = POLLIN};
+        ssize_t n;
+        if (poll(&pfd, 1, wait > 0 ? wait : 0) > 0 && (n = recv(udpfd, buf, sizeof(buf), 0)) > 0) {
+            // an ack, then a snapshot or a delta
+            unsigned char *p = (unsigned char *) buf;
+            size_t len = (p[0] << 8) | p[1];
+            size_t next = FRAME_HEADER + len;
+            if (n >= FRAME_HEADER + 8 && p[2] == FRAME_ACK && len == 8 && (size_t) n >= next + FRAME_HEADER &&
+                (size_t) n >= next + FRAME_HEADER + ((p[next] << 8) | p[next + 1])) {
+                unsigned ack = (p[3] << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+                unsigned tick = (p[7] << 24) | (p[8] << 16) | (p[9] << 8) | p[10];
+                applyUpdate(p[next + 2], buf + next + FRAME_HEADER, (p[next] << 8) | p[next + 1], tick, ack);
+                udpSnapshots++;
+            }
+        }
+        if ((int) (SDL_GetTicks() - lastUdpSend) >= UDP_INTERVAL)
+            sendMoves();
+    }
+    return NULL;
+}
+
+// Point the datagram socket at the server's address and the port it gave us
+// (relative to the one we connected to), starting the transport the first time
+void openUdp(unsigned offset)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    getpeername(serverfd, (SA*) &addr, &len);
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*) &addr;
+        in6->sin6_port = htons(ntohs(in6->sin6_port) + offset);
+    }
+    else {
+        struct sockaddr_in* in = (struct sockaddr_in*) &addr;
+        in->sin_port = htons(ntohs(in->sin_port) + offset);
+    }
+    int fd = udpfd >= 0 ? udpfd : socket(addr.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (SA*) &addr, len) < 0) {
+        fprintf(stderr, "cannot use UDP: %s\n", strerror(errno));
+        return;
+    }
+    if (udpfd < 0) {
+        pthread_t tid;
+        udpfd = fd;
+        Pthread_create(&tid, NULL, udpTransport, NULL);
+    }
+}
+
+bool isUpdate(FRAMETYPE type)
+{
+    return type == FRAME_SNAPSHOT || type == FRAME_DELTA || type == FRAME_PACKED || type == FRAME_PACKED_DELTA;
+}
+
+// Reads frames up to and including the next snapshot or delta, false once
+// the connection is gone
+bool update(rio_t *rio, char *buf) {
+
+	// the last of our inputs the server has processed and the tick of the
+	// snapshot that follows, sent before each snapshot
+	static unsigned ack;
+	static unsigned tick;
+	FRAMETYPE type;
+	ssize_t n;
+	unsigned char *p = (unsigned char *) buf;
+	while ((n = readFrame(rio, &type, buf, MAXLINE)) > 0 && !isUpdate(type)) {
+		if (type == FRAME_WELCOME && n >= 1) {
+			P(&mutex);
+			localPlayer = p[0];
+			resumeToken = 0;
+			if (n == 9) {
+				for (int i = 1; i < 9; i++)
+					resumeToken = resumeToken << 8 | p[i];
 			}
-			c++;
+			V(&mutex);
+		}
+		else if (type == FRAME_ACK && n >= 4) {
+			ack = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			if (n == 8)
+				tick = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
 		}
+		else if (type == FRAME_UDP && n == 2 && useUdp)
+			openUdp((p[0] << 8) | p[1]);
 	}
-	char s[10];
-	char l[10];
-	char x[10];
-	char y[10];
-	strncpy(s, buf+100, (buf+105) - (buf+100));
-	strncpy(l, buf+105, (buf+110) - (buf+105));
-	score = atoi(s) - 10000;
-	level = atoi(l) - 10000;
-	strncpy(x, buf+110, (buf+112) - (buf+110));
-	strncpy(y, buf+112, (buf+114) - (buf+112));
-	playerPosition[0].x = atoi(x) - 20;
-	playerPosition[0].y = atoi(y) - 20;
-	
-	strncpy(x, buf+114, (buf+116) - (buf+114));
-	strncpy(y, buf+116, (buf+118) - (buf+116));
-	playerPosition[1].x = atoi(x) - 20;
-	playerPosition[1].y = atoi(y) - 20;
-	
-	strncpy(x, buf+118, (buf+120) - (buf+118));
-	strncpy(y, buf+120, (buf+122) - (buf+120));
-	playerPosition[2].x = atoi(x) - 20;
-	playerPosition[2].y = atoi(y) - 20;
-	
-	strncpy(x, buf+122, (buf+124) - (buf+122));
-	strncpy(y, buf+124, (buf+126) - (buf+124));
-	playerPosition[3].x = atoi(x) - 20;
-	playerPosition[3].y = atoi(y) - 20;
+	if (n <= 0)
+		return false;
+	applyUpdate(type, buf, n, tick, ack);
+	return true;
 }
 
-void networking(int clientfd, rio_t rio, char *buf) {
-        int input = processInputs(clientfd, rio);
-        if (input == 0) {
-        	return;
-        }
-        else if (input == 1) {
-        strcpy(buf, "up\n");
-	Rio_writen(clientfd, buf, strlen(buf));
-        }
-        else if (input == 2) {
-        strcpy(buf, "down\n");
-	Rio_writen(clientfd, buf, strlen(buf));
-        }
-        else if (input == 3) {
-        strcpy(buf, "left\n");
-	Rio_writen(clientfd, buf, strlen(buf));
-        }
-        else if (input == 4) {
-        strcpy(buf, "right\n");
-	Rio_writen(clientfd, buf, strlen(buf));
+void networking() {
+	InputBatch batch;
+	batch.len = 0;
+	batch.quit = false;
+	processInputs(&batch);
+	if (batch.len > 0)
+		sendBatch(&batch);
+}
+
+// Reconnect and ask for our player back, with the moves the server may not
+// have seen (it skips those it has), or watch the room again. False if the
+// server can't be reached before it gives the slot away.
+bool reconnect(rio_t *rio)
+{
+    Uint32 start = SDL_GetTicks();
+    while ((resumeToken != 0 || watchedRoom >= 0) && !shouldExit && SDL_GetTicks() - start < RESUME_WINDOW) {
+        int fd = open_clientfd(serverHost, serverPort);
+        if (fd >= 0) {
+            char buf[MAXLINE];
+            int len;
+            // no move goes to the old connection once the pending ones are copied
+            P(&sendMutex);
+            if (watchedRoom >= 0)
+                len = sprintf(buf, "watch %d\n", watchedRoom);
+            else {
+                P(&mutex);
+                len = sprintf(buf, "resume %llx %u\ncompact\n%s", (unsigned long long) resumeToken,
+                              newestTick, useUdp ? "udp\n" : "");
+                for (int i = 0; i < pendingCount; i++)
+                    len += sprintf(buf + len, "%s %u\n", commandNames[pending[i].input], pending[i].seq);
+                V(&mutex);
+            }
+            bool sent = rio_writen(fd, buf, len) == len;
+            if (sent)
+                dup2(fd, serverfd);
+            V(&sendMutex);
+            close(fd);
+            if (sent) {
+                Rio_readinitb(rio, serverfd);
+                return true;
+            }
         }
+        SDL_Delay(250);
+    }
+    return false;
 }
 
+// Applies snapshots as soon as they arrive; the read blocks until there is one
 void *updater(void *vargp) {
-	int clientfd = *(int*)vargp;
+	rio_t *rio = vargp;
 	Pthread_detach(pthread_self());
-	rio_t rio;
-	Rio_readinitb(&rio, clientfd);
 	char buf[MAXLINE];
 	while (!shouldExit) {
-	update(clientfd, rio, buf);
-	usleep(16000);
+	if (!update(rio, buf) && (shouldExit || !reconnect(rio))) {
+		// server went away for good, let the render loop finish
+		shouldExit = true;
+		SDL_Event quit;
+		SDL_zero(quit);
+		quit.type = SDL_QUIT;
+		SDL_PushEvent(&quit);
+	}
 	}
 	return NULL;
 }
 
+// Frame-time benchmark for drawing BENCH_CELLS x BENCH_CELLS tiles, comparing
+// one texture per sprite against the atlas. Run with: client --bench
+#define BENCH_CELLS 100
+#define BENCH_TILE 8
+#define BENCH_FRAMES 300
+
+double benchFrames(SDL_Renderer* renderer, SDL_Texture* target, SDL_Texture** textures, const SDL_Rect* src, int cells[BENCH_CELLS][BENCH_CELLS])
+{
+    SDL_Rect dest = { 0, 0, BENCH_TILE, BENCH_TILE };
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        SDL_SetRenderTarget(renderer, target);
+        for (int i = 0; i < BENCH_CELLS; i++) {
+            for (int j = 0; j < BENCH_CELLS; j++) {
+                int sprite = (cells[i][j] + f) % SPRITE_COUNT;
+                dest.x = BENCH_TILE * i;
+                dest.y = BENCH_TILE * j;
+                SDL_RenderCopy(renderer, textures[sprite], src ? &src[sprite] : NULL, &dest);
+            }
+        }
+        SDL_SetRenderTarget(renderer, NULL);
+        SDL_RenderCopy(renderer, target, NULL, NULL);
+        SDL_RenderPresent(renderer);
+    }
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    return 1000.0 * elapsed / SDL_GetPerformanceFrequency() / BENCH_FRAMES;
+}
+
+void runBenchmark()
+{
+    initSDL();
+    SDL_SetHint(SDL_HINT_RENDER_BATCHING, "1");
+
+    int size = BENCH_CELLS * BENCH_TILE;
+    SDL_Window* window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, size, size, SDL_WINDOW_HIDDEN);
+    SDL_Renderer* renderer = window ? SDL_CreateRenderer(window, -1, 0) : NULL;
+    if (renderer == NULL) {
+        fprintf(stderr, "Error creating renderer: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    SDL_Texture* target = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, size, size);
+
+    int cells[BENCH_CELLS][BENCH_CELLS];
+    for (int i = 0; i < BENCH_CELLS; i++)
+        for (int j = 0; j < BENCH_CELLS; j++)
+            cells[i][j] = rand() % SPRITE_COUNT;
+
+    SDL_Texture* separate[SPRITE_COUNT];
+    SDL_Texture* shared[SPRITE_COUNT];
+    atlas = loadAtlas(renderer);
+    for (int i = 0; i < SPRITE_COUNT; i++) {
+        separate[i] = IMG_LoadTexture(renderer, spriteFiles[i]);
+        shared[i] = atlas;
+    }
+
+    double separateMs = benchFrames(renderer, target, separate, NULL, cells);
+    double atlasMs = benchFrames(renderer, target, shared, spriteRect, cells);
+    printf("%dx%d cells, %d frames\n", BENCH_CELLS, BENCH_CELLS, BENCH_FRAMES);
+    printf("separate textures: %.3f ms/frame\n", separateMs);
+    printf("atlas:             %.3f ms/frame\n", atlasMs);
+
+    for (int i = 0; i < SPRITE_COUNT; i++)
+        SDL_DestroyTexture(separate[i]);
+    SDL_DestroyTexture(atlas);
+    SDL_DestroyTexture(target);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    IMG_Quit();
+    TTF_Quit();
+    SDL_Quit();
+}
+
+// Read a headless input script. Blank lines and lines starting with # are skipped.
+void loadScript(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        unix_error("Error opening input script");
+
+    int capacity = 64;
+    script = Malloc(capacity * sizeof(ScriptedInput));
+    char line[MAXLINE];
+    int lineno = 0;
+    while (Fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        unsigned time;
+        char command[16];
+        if (line[0] == '#' || sscanf(line, "%u %15s", &time, command) != 2)
+            continue;
+
+        int input = -1;
+        for (int i = 0; i < 5; i++) {
+            if (strcmp(command, commandNames[i]) == 0)
+                input = i;
+        }
+        if (input < 0) {
+            fprintf(stderr, "%s:%d: unknown command '%s'\n", path, lineno, command);
+            exit(1);
+        }
+
+        if (scriptLength == capacity) {
+            capacity *= 2;
+            ScriptedInput* grown = Malloc(capacity * sizeof(ScriptedInput));
+            memcpy(grown, script, scriptLength * sizeof(ScriptedInput));
+            Free(script);
+            script = grown;
+        }
+        script[scriptLength].time = time;
+        script[scriptLength].input = input;
+        scriptLength++;
+    }
+    fclose(f);
+}
+
+// Play the input script through the normal input path, then quit
+void runHeadless()
+{
+    Uint32 start = SDL_GetTicks();
+    int next = 0;
+    while (!shouldExit) {
+        InputBatch batch;
+        batch.len = 0;
+        batch.quit = false;
+
+        Uint32 now = SDL_GetTicks() - start;
+        while (next < scriptLength && script[next].time <= now)
+            addInput(&batch, script[next++].input);
+        if (next == scriptLength)
+            addInput(&batch, 0);
+        if (batch.len > 0)
+            sendBatch(&batch);
+
+        if (!shouldExit) {
+            Uint32 wait = script[next].time - now;
+            SDL_Delay(wait < 100 ? wait : 100);
+        }
+    }
+
+    P(&mutex);
+    printf("decoded %u snapshots, %.2f us each\n", snapshotsDecoded,
+           snapshotsDecoded ? 1e6 * decodeTicks / SDL_GetPerformanceFrequency() / snapshotsDecoded : 0.0);
+    if (useUdp)
+        printf("%u snapshot datagrams received\n", udpSnapshots);
+    if (movesRefused > 0)
+        printf("%u moves refused with %d unacknowledged\n", movesRefused, MAX_PENDING);
+    V(&mutex);
+}
+
+#define USAGE "usage: %s [-i interp_ms] [-f fps] [-v] [-H script] [-u] [-I impairment] [-W room] <host> <port>\n"
+
 int main(int argc, char* argv[])
 {
-for (int i = 0; i < 4; i++) {
-	playerPosition[i].x == -1;
-	playerPosition[i].y == -1;
+if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+	runBenchmark();
+	return 0;
 }
-	int clientfd, count;
-	char *host, *port, buf[MAXLINE];
+	int opt;
+	while ((opt = getopt(argc, argv, "i:f:vH:uI:W:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interpDelay = atoi(optarg);
+				break;
+			case 'f':
+				targetFps = atoi(optarg);
+				break;
+			case 'v':
+				vsync = true;
+				break;
+			case 'H':
+				headless = true;
+				loadScript(optarg);
+				break;
+			case 'u':
+				useUdp = true;
+				break;
+			case 'W':
+				watchedRoom = atoi(optarg);
+				break;
+			case 'I':
+				if (!initImpair(&impair, optarg)) {
+					fprintf(stderr, "bad impairment: %s\n", optarg);
+					exit(1);
+				}
+				impaired = &impair;
+				break;
+			default:
+				fprintf(stderr, USAGE, argv[0]);
+				exit(1);
+		}
+	}
+	if (argc - optind != 2 || interpDelay < 0 || targetFps <= 0) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(1);
+	}
+	int count;
+	char buf[MAXLINE];
 	rio_t rio;
 	pthread_t tid;
+
+	// nobody is on the grid until the first snapshot says so
+	for (int i = 0; i < MAX_PLAYERS; i++)
+		despawnPlayer(&state, i);
 	
-	host = argv[1];
-	port = argv[2];
+	serverHost = argv[optind];
+	serverPort = argv[optind + 1];
 	
-	clientfd = Open_clientfd(host, port);
-	Rio_readinitb(&rio, clientfd);
-	Pthread_create(&tid, NULL, updater, &clientfd);
+	// a write to a dropped connection fails instead of killing us
+	signal(SIGPIPE, SIG_IGN);
+	serverfd = Open_clientfd(serverHost, serverPort);
+	Rio_readinitb(&rio, serverfd);
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&sendMutex, 0, 1);
 	
     srand(time(NULL));
 
+    // Get initial game state
+    if (watchedRoom >= 0) {
+        sprintf(buf, "watch %d\n", watchedRoom);
+    }
+    else {
+        strcpy(buf, useUdp ? "start\ncompact\nudp\n" : "start\ncompact\n");
+    }
+	Rio_writen(serverfd, buf, strlen(buf));
+	update(&rio, buf);
+	// only start reading snapshots in the background once the initial one is in
+	Pthread_create(&tid, NULL, updater, &rio);
+
+	if (headless) {
+		runHeadless();
+		Close(serverfd);
+		return 0;
+	}
+
     initSDL();
+    wakeEvent = SDL_RegisterEvents(1);
+    frameBudget = SDL_GetPerformanceFrequency() / targetFps;
 
     font = TTF_OpenFont("resources/Burbank-Big-Condensed-Bold-Font.otf", HEADER_HEIGHT);
     if (font == NULL) {
         fprintf(stderr, "Error loading font: %s\n", TTF_GetError());
         exit(EXIT_FAILURE);
     }
-    
-    // Get initial game state
-    strcpy(buf, "start\n");
-	Rio_writen(clientfd, buf, strlen(buf));
-	update(clientfd, rio, buf);
 
-    SDL_Window* window = SDL_CreateWindow("Client", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, 0);
+    SDL_Window* window = SDL_CreateWindow("Client", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_RESIZABLE);
 
     if (window == NULL) {
         fprintf(stderr, "Error creating app window: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 0);
+    // lets consecutive copies from the atlas be submitted as one batch
+    SDL_SetHint(SDL_HINT_RENDER_BATCHING, "1");
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
 
 	if (renderer == NULL)
 	{
 		fprintf(stderr, "Error creating renderer: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
 	}
-	SDL_Texture *playerTexture[4];
-
-    SDL_Texture *grassTexture = IMG_LoadTexture(renderer, "resources/grass.png");
-    SDL_Texture *tomatoTexture = IMG_LoadTexture(renderer, "resources/tomato.png");
-    playerTexture[0] = IMG_LoadTexture(renderer, "resources/player.png");
-    playerTexture[1] = IMG_LoadTexture(renderer, "resources/player2.png");
-    playerTexture[2] = IMG_LoadTexture(renderer, "resources/player3.png");
-    playerTexture[3] = IMG_LoadTexture(renderer, "resources/player4.png");
+    atlas = loadAtlas(renderer);
 	size_t n;
     // GAME RUNNING LOOP
     while (!shouldExit) {
@@ -557,33 +1244,50 @@ for (int i = 0; i < 4; i++) {
 		continue;
 	}
 	printf("buf = %s\n", buf);
-	Rio_writen(clientfd, buf, strlen(buf));
+	Rio_writen(serverfd, buf, strlen(buf));
 	Rio_readlineb(&rio, buf,MAXLINE);
 	Fputs(buf, stdout);*/
 	
 	// OLD GAME CODE
-        SDL_SetRenderDrawColor(renderer, 0, 105, 6, 255);
-        SDL_RenderClear(renderer);
-
-	networking(clientfd, rio, buf);
+	Uint64 frameStart = SDL_GetPerformanceCounter();
+	networking();
         // update the game state
 
-        drawGrid(renderer, grassTexture, tomatoTexture, playerTexture);
-        drawUI(renderer);
-
-        SDL_RenderPresent(renderer);
+        // Nothing visible changed since the last present, keep showing it
+        P(&mutex);
+        bool drawn = frameDirty;
+        if (frameDirty) {
+            updateCamera(renderer);
+            drawBackground(renderer);
+            SDL_SetRenderDrawColor(renderer, 0, 105, 6, 255);
+            SDL_RenderClear(renderer);
+            frameDirty = false;
+            drawGrid(renderer, SDL_GetTicks());
+            drawUI(renderer);
+            SDL_RenderPresent(renderer);
+        }
+        bool idle = !frameDirty;
+        V(&mutex);
 
-        SDL_Delay(16); // 16 ms delay to limit display to 60 fps
+        if (idle) {
+            // nothing to animate: sleep until input or a snapshot arrives
+            SDL_WaitEventTimeout(NULL, 1000);
+        }
+        else if (!(drawn && vsync)) {
+            // sleep only what is left of this frame's budget; with vsync the
+            // present already waited for the display
+            Uint64 frameCost = SDL_GetPerformanceCounter() - frameStart;
+            if (frameCost < frameBudget)
+                SDL_Delay((frameBudget - frameCost) * 1000 / SDL_GetPerformanceFrequency());
+        }
     }
-	Close(clientfd);
+	Close(serverfd);
 
     // clean up everything
-    SDL_DestroyTexture(grassTexture);
-    SDL_DestroyTexture(tomatoTexture);
-    SDL_DestroyTexture(playerTexture[0]);
-    SDL_DestroyTexture(playerTexture[1]);
-    SDL_DestroyTexture(playerTexture[2]);
-    SDL_DestroyTexture(playerTexture[3]);
+    SDL_DestroyTexture(background.texture);
+    SDL_DestroyTexture(atlas);
+    freeTextCache(&scoreText);
+    freeTextCache(&levelText);
 
     TTF_CloseFont(font);
     TTF_Quit();
@@ -0,0 +1,156 @@
+#include "frame.h"
+
+void initFrameQueue(FrameQueue *q, int fd)
+{
+    q->fd = fd;
+    q->iovcnt = 0;
+    q->scratchUsed = 0;
+    q->pending = 0;
+    q->frames = 0;
+    q->flushes = 0;
+    q->syscalls = 0;
+}
+
+bool framesFit(const FrameQueue *q, size_t bytes, int frames)
+{
+    return q->scratchUsed + frames * FRAME_HEADER + bytes <= FRAMEQ_SCRATCH &&
+           q->iovcnt + 2 * frames <= FRAMEQ_MAXIOV;
+}
+
+static void push(FrameQueue *q, const void *base, size_t len)
+{
+    // extend the previous iovec when the bytes are contiguous with it
+    if (q->iovcnt > 0) {
+        struct iovec *last = &q->iov[q->iovcnt - 1];
+        if ((const char *) last->iov_base + last->iov_len == (const char *) base) {
+            last->iov_len += len;
+            q->pending += len;
+            return;
+        }
+    }
+    q->iov[q->iovcnt].iov_base = (void *) base;
+    q->iov[q->iovcnt].iov_len = len;
+    q->iovcnt++;
+    q->pending += len;
+}
+
+static char *header(FrameQueue *q, FRAMETYPE type, size_t len)
+{
+    char *h = q->scratch + q->scratchUsed;
+    h[0] = (len >> 8) & 0xff;
+    h[1] = len & 0xff;
+    h[2] = type;
+    q->scratchUsed += FRAME_HEADER;
+    push(q, h, FRAME_HEADER);
+    return h;
+}
+
+int queueFrame(FrameQueue *q, FRAMETYPE type, const void *payload, size_t len)
+{
+    if (len > FRAMEQ_MAXCOPY || !framesFit(q, len, 1))
+        return -1;
+    header(q, type, len);
+    char *copy = q->scratch + q->scratchUsed;
+    memcpy(copy, payload, len);
+    q->scratchUsed += len;
+    push(q, copy, len);
+    q->frames++;
+    return 0;
+}
+
+int queueFrameRef(FrameQueue *q, FRAMETYPE type, const void *payload, size_t len)
+{
+    if (len > FRAME_MAXPAYLOAD || !framesFit(q, 0, 1))
+        return -1;
+    header(q, type, len);
+    push(q, payload, len);
+    q->frames++;
+    return 0;
+}
+
+void clearFrames(FrameQueue *q)
+{
+    q->iovcnt = 0;
+    q->scratchUsed = 0;
+    q->pending = 0;
+}
+
+ssize_t flushFrames(FrameQueue *q)
+{
+    size_t left = q->pending;
+    struct iovec *iov = q->iov;
+    int iovcnt = q->iovcnt;
+
+    if (left > 0)
+        q->flushes++;
+    while (iovcnt > 0) {
+        ssize_t n = writev(q->fd, iov, iovcnt);
+        q->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            clearFrames(q);
+            return -1;
+        }
+        left -= n;
+        // skip what was written, the rest goes out with the next writev
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    ssize_t written = q->pending - left;
+    if (iovcnt == 0) {
+        clearFrames(q);
+        return written;
+    }
+    // the socket is full: keep what it didn't take, the scratch it points
+    // into stays where it is
+    memmove(q->iov, iov, iovcnt * sizeof(*iov));
+    q->iovcnt = iovcnt;
+    q->pending = left;
+    return written;
+}
+
+ssize_t gatherFrames(FrameQueue *q, char *buf, size_t len)
+{
+    size_t total = q->pending;
+    if (total > len)
+        return -1;
+
+    size_t c = 0;
+    for (int i = 0; i < q->iovcnt; i++) {
+        memcpy(buf + c, q->iov[i].iov_base, q->iov[i].iov_len);
+        c += q->iov[i].iov_len;
+    }
+    if (total > 0)
+        q->flushes++;
+    clearFrames(q);
+    return total;
+}
+
+ssize_t readFrame(rio_t *rp, FRAMETYPE *type, void *payload, size_t maxlen)
+{
+    unsigned char h[FRAME_HEADER];
+    ssize_t n = rio_readnb(rp, h, FRAME_HEADER);
+    if (n <= 0)
+        return n;
+    if (n < FRAME_HEADER)
+        return -1;
+
+    size_t len = (h[0] << 8) | h[1];
+    *type = h[2];
+    if (len > maxlen)
+        return -1;
+    if (rio_readnb(rp, payload, len) != (ssize_t) len)
+        return -1;
+    return len;
+}
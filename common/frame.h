@@ -0,0 +1,84 @@
+// Length-prefixed framing for the server -> client stream. Each frame is a
+// 3-byte header, the payload length (16 bits, big endian) and a FRAMETYPE,
+// followed by the payload.
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "csapp.h"
+
+#define FRAME_HEADER 3
+#define FRAME_MAXPAYLOAD 65535
+#define CHAT_MAXLEN 200 // longer chat text is cut
+
+typedef enum
+{
+    FRAME_WELCOME = 1,  // 1 byte: index of the receiving player, 8 bytes: resume token
+    FRAME_ACK,          // 4 bytes: sequence number of the last processed command,
+                        // 4 bytes: tick of the snapshot or delta that follows
+    FRAME_SNAPSHOT,     // encodeSnapshot() text
+    FRAME_PONG,         // the argument of a ping command
+    FRAME_CHAT,         // 1 byte: index of the sender, then the text of a chat command
+    FRAME_DELTA,        // 4 bytes: tick of the base snapshot, then encodeDelta() bytes
+    FRAME_UDP,          // 2 bytes: the port to send datagrams to, as an offset from the
+                        // one connected to (so it holds through a proxy), in reply to udp
+    FRAME_PACKED,       // packSnapshot() keyframe, instead of FRAME_SNAPSHOT after compact
+    FRAME_PACKED_DELTA, // 4 bytes: tick of the base snapshot, then a packSnapshot() delta
+    FRAME_ROOMS         // 2 bytes: how many rooms the server has, in reply to rooms
+} FRAMETYPE;
+
+// Frames queued for one connection and written with a single writev per flush.
+// Headers and copied payloads live in scratch; referenced payloads are only
+// pointed to, so a frame shared by many connections is encoded once.
+#define FRAMEQ_MAXIOV 64
+#define FRAMEQ_SCRATCH 2048
+#define FRAMEQ_MAXCOPY (FRAMEQ_SCRATCH - FRAME_HEADER) // the longest payload queueFrame takes
+
+typedef struct
+{
+    int fd;
+    struct iovec iov[FRAMEQ_MAXIOV];
+    int iovcnt;
+    char scratch[FRAMEQ_SCRATCH];
+    size_t scratchUsed;
+    size_t pending;           // bytes queued
+    unsigned long frames;     // frames queued since init
+    unsigned long flushes;    // flushes that had something to write
+    unsigned long syscalls;   // writev calls
+} FrameQueue;
+
+void initFrameQueue(FrameQueue *q, int fd);
+
+// Queue a frame, copying the payload. Never writes: returns -1, queueing
+// nothing, if the queue is full (send it and queue again) or len is over
+// FRAMEQ_MAXCOPY.
+int queueFrame(FrameQueue *q, FRAMETYPE type, const void *payload, size_t len);
+
+// Queue a frame without copying the payload, which must stay untouched until
+// the next flush. Returns -1 like queueFrame when the queue is full.
+int queueFrameRef(FrameQueue *q, FRAMETYPE type, const void *payload, size_t len);
+
+// Whether frames more frames, with bytes of copied payloads between them, fit
+bool framesFit(const FrameQueue *q, size_t bytes, int frames);
+
+// Write everything queued, in one writev unless the socket takes less. On a
+// non-blocking socket that fills up, what it didn't take stays queued.
+// Returns the number of bytes written, -1 on error (the queue is then emptied).
+ssize_t flushFrames(FrameQueue *q);
+
+// Drop everything queued
+void clearFrames(FrameQueue *q);
+
+// Copy everything queued into buf and empty the queue, for callers that hand
+// the bytes to the kernel asynchronously. Returns the number of bytes, -1
+// (leaving the queue untouched) if they don't fit in len.
+ssize_t gatherFrames(FrameQueue *q, char *buf, size_t len);
+
+// Read the next frame into payload. Returns the payload length, 0 on EOF and
+// -1 on error, a truncated frame or one longer than maxlen.
+ssize_t readFrame(rio_t *rp, FRAMETYPE *type, void *payload, size_t maxlen);
+
+#endif /* __FRAME_H__ */
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+
+// Cell offsets for each DIRECTION
+static const int moveDx[] = { 0, 0, 0, -1, 1 };
+static const int moveDy[] = { 0, -1, 1, 0, 0 };
+
+// Letters for players 0-3 in snapshots
+static const char playerLetter[MAX_PLAYERS] = { 'P', 'A', 'B', 'C' };
+
+// get a random value in the range [0, 1] (xorshift32, the same on every platform)
+static double rand01(GameState *game)
+{
+    unsigned x = game->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    game->seed = x;
+    return (double) x / (double) 0xFFFFFFFFu;
+}
+
+void initGame(GameState *game, unsigned seed)
+{
+    // xorshift never leaves 0
+    game->seed = seed ? seed : 1;
+    game->score = 0;
+    game->level = 1;
+    game->numTomatoes = 0;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        despawnPlayer(game, i);
+    initGrid(game);
+}
+
+void initGrid(GameState *game)
+{
+    // ensure grid isn't empty
+    do {
+        game->numTomatoes = 0;
+        for (int i = 0; i < GRIDSIZE; i++) {
+            for (int j = 0; j < GRIDSIZE; j++) {
+                if (rand01(game) < 0.1) {
+                    game->grid[i][j] = TILE_TOMATO;
+                    game->numTomatoes++;
+                }
+                else
+                    game->grid[i][j] = TILE_GRASS;
+            }
+        }
+
+        for (int i = 0; i < MAX_PLAYERS; i++) {
+            int a = game->playerPosition[i].x;
+            int b = game->playerPosition[i].y;
+            if (a < 0 || b < 0)
+                continue;
+            if (game->grid[a][b] == TILE_TOMATO) {
+                game->grid[a][b] = TILE_GRASS;
+                game->numTomatoes--;
+            }
+        }
+    } while (game->numTomatoes == 0);
+}
+
+MOVERESULT moveTo(GameState *game, int x, int y, int player)
+{
+    Position *pos = game->playerPosition;
+
+    // Prevent falling off the grid
+    if (x < 0 || x >= GRIDSIZE || y < 0 || y >= GRIDSIZE)
+        return MOVE_OFF_GRID;
+
+    // Sanity check: player can only move to 4 adjacent squares
+    if (!(abs(pos[player].x - x) == 1 && abs(pos[player].y - y) == 0) &&
+        !(abs(pos[player].x - x) == 0 && abs(pos[player].y - y) == 1))
+        return MOVE_NOT_ADJACENT;
+
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (i != player && x == pos[i].x && y == pos[i].y)
+            return MOVE_BLOCKED;
+    }
+
+    pos[player].x = x;
+    pos[player].y = y;
+
+    if (game->grid[x][y] == TILE_TOMATO) {
+        game->grid[x][y] = TILE_GRASS;
+        game->score++;
+        game->numTomatoes--;
+        if (game->numTomatoes == 0) {
+            game->level++;
+            initGrid(game);
+        }
+    }
+    return MOVE_OK;
+}
+
+MOVERESULT movePlayer(GameState *game, int player, DIRECTION dir)
+{
+    Position pos = game->playerPosition[player];
+    return moveTo(game, pos.x + moveDx[dir], pos.y + moveDy[dir], player);
+}
+
+bool spawnPlayer(GameState *game, int player)
+{
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++) {
+            if (game->grid[i][j] != TILE_GRASS)
+                continue;
+            bool taken = false;
+            for (int z = 0; z < MAX_PLAYERS; z++) {
+                if (z != player && i == game->playerPosition[z].x && j == game->playerPosition[z].y) {
+                    taken = true;
+                    break;
+                }
+            }
+            if (taken)
+                continue;
+            game->playerPosition[player].x = i;
+            game->playerPosition[player].y = j;
+            return true;
+        }
+    }
+    return false;
+}
+
+void despawnPlayer(GameState *game, int player)
+{
+    game->playerPosition[player].x = -1;
+    game->playerPosition[player].y = -1;
+}
+
+static char cellLetter(const GameState *game, int i, int j)
+{
+    for (int p = 0; p < MAX_PLAYERS; p++) {
+        if (i == game->playerPosition[p].x && j == game->playerPosition[p].y)
+            return playerLetter[p];
+    }
+    return game->grid[i][j] == TILE_TOMATO ? 'T' : 'G';
+}
+
+void printGrid(const GameState *game)
+{
+    printf("GRID\n");
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++)
+            printf("%c", cellLetter(game, i, j));
+        printf("\n");
+    }
+}
+
+int encodeSnapshot(const GameState *game, char *buf)
+{
+    int c = 0;
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++)
+            buf[c++] = cellLetter(game, i, j);
+    }
+    c += sprintf(buf + c, "%05d%05d", game->score + 10000, game->level + 10000);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        c += sprintf(buf + c, "%02d%02d", game->playerPosition[i].x + 20, game->playerPosition[i].y + 20);
+    c += sprintf(buf + c, "%u", game->seed);
+    return c;
+}
+
+// Parse a fixed-width decimal field
+static int field(const char *buf, int width)
+{
+    int v = 0;
+    for (int i = 0; i < width; i++)
+        v = v * 10 + (buf[i] - '0');
+    return v;
+}
+
+bool decodeSnapshot(const char *buf, size_t len, GameState *game)
+{
+    if (len < SNAPSHOT_FIXED_LEN)
+        return false;
+
+    int c = 0;
+    game->numTomatoes = 0;
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++) {
+            if (buf[c++] == 'T') {
+                game->grid[i][j] = TILE_TOMATO;
+                game->numTomatoes++;
+            }
+            else
+                game->grid[i][j] = TILE_GRASS;
+        }
+    }
+    game->score = field(buf + c, 5) - 10000;
+    game->level = field(buf + c + 5, 5) - 10000;
+    c += 10;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        game->playerPosition[i].x = field(buf + c, 2) - 20;
+        game->playerPosition[i].y = field(buf + c + 2, 2) - 20;
+        c += 4;
+    }
+    unsigned seed = 0;
+    for (; (size_t) c < len; c++)
+        seed = seed * 10 + (buf[c] - '0');
+    game->seed = seed;
+    return true;
+}
+
+int encodeDelta(const char *base, const char *snap, int len, char *out)
+{
+    int c = 1;
+    int count = 0;
+    for (int i = 0; i < GRIDSIZE * GRIDSIZE; i++) {
+        if (base[i] == snap[i])
+            continue;
+        if (++count > DELTA_MAXCELLS)
+            return -1;
+        out[c++] = i;
+        out[c++] = snap[i];
+    }
+    out[0] = count;
+    memcpy(out + c, snap + GRIDSIZE * GRIDSIZE, len - GRIDSIZE * GRIDSIZE);
+    return c + len - GRIDSIZE * GRIDSIZE;
+}
+
+int applyDelta(char *snap, const char *delta, size_t len)
+{
+    if (len < 1)
+        return -1;
+    size_t c = 1 + 2 * (size_t) (unsigned char) delta[0];
+    if (c > len || GRIDSIZE * GRIDSIZE + len - c > SNAPSHOT_MAXLEN)
+        return -1;
+    for (size_t i = 1; i < c; i += 2) {
+        unsigned char cell = delta[i];
+        if (cell >= GRIDSIZE * GRIDSIZE)
+            return -1;
+        snap[cell] = delta[i + 1];
+    }
+    memcpy(snap + GRIDSIZE * GRIDSIZE, delta + c, len - c);
+    return GRIDSIZE * GRIDSIZE + len - c;
+}
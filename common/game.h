@@ -0,0 +1,102 @@
+// Game rules, state layout and snapshot codec shared by the client and the
+// server. Everything here is deterministic and works on caller-owned state
+// without allocating, so prediction, replays and benchmarks run the same code.
+#ifndef __GAME_H__
+#define __GAME_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of cells vertically/horizontally in the grid
+#define GRIDSIZE 10
+
+#define MAX_PLAYERS 4
+
+typedef struct
+{
+    int x;
+    int y;
+} Position;
+
+typedef enum
+{
+    TILE_GRASS,
+    TILE_TOMATO
+} TILETYPE;
+
+// Movement directions, numbered as the client's input codes
+typedef enum
+{
+    DIR_UP = 1,
+    DIR_DOWN,
+    DIR_LEFT,
+    DIR_RIGHT
+} DIRECTION;
+
+typedef enum
+{
+    MOVE_OK,
+    MOVE_OFF_GRID,
+    MOVE_NOT_ADJACENT,
+    MOVE_BLOCKED
+} MOVERESULT;
+
+// A player not in the game is at (-1, -1)
+typedef struct
+{
+    TILETYPE grid[GRIDSIZE][GRIDSIZE];
+    Position playerPosition[MAX_PLAYERS];
+    int score;
+    int level;
+    int numTomatoes;
+    unsigned seed; // random state, the next level's tomatoes are drawn from it
+} GameState;
+
+// Start a level 1 game with no players
+void initGame(GameState *game, unsigned seed);
+
+// Scatter tomatoes for a new level, never under a player
+void initGrid(GameState *game);
+
+// Move a player to (x, y). Picks up a tomato there and starts the next level
+// once the last one is collected.
+MOVERESULT moveTo(GameState *game, int x, int y, int player);
+MOVERESULT movePlayer(GameState *game, int player, DIRECTION dir);
+
+// Place a player on the first free grass cell, false if there is none
+bool spawnPlayer(GameState *game, int player);
+void despawnPlayer(GameState *game, int player);
+
+// Print the grid with the snapshot letters, for debugging
+void printGrid(const GameState *game);
+
+// Snapshot payload, the same bytes for every player (see frame.h for how it
+// is delimited and how the per-player index and ack are sent):
+//   GRIDSIZE*GRIDSIZE cells, column-major: G grass, T tomato, P/A/B/C players 0-3
+//   score + 10000 and level + 10000, five digits each
+//   x + 20 and y + 20 of each player, two digits each
+//   the random seed in decimal
+#define SNAPSHOT_FIXED_LEN (GRIDSIZE * GRIDSIZE + 10 + 4 * MAX_PLAYERS + 1)
+#define SNAPSHOT_MAXLEN (SNAPSHOT_FIXED_LEN + 10)
+
+// Returns the encoded length, buf must hold SNAPSHOT_MAXLEN + 1 bytes
+int encodeSnapshot(const GameState *game, char *buf);
+
+// Returns false if buf is not a complete snapshot
+bool decodeSnapshot(const char *buf, size_t len, GameState *game);
+
+// Delta payload, a snapshot given as its differences from an earlier one:
+//   the number of cells that changed, then each one's index and letter
+//   the rest of the snapshot after the grid, as is
+// With more cells changed than DELTA_MAXCELLS the full snapshot is smaller.
+#define DELTA_MAXCELLS ((GRIDSIZE * GRIDSIZE - 1) / 2)
+
+// Returns the delta length, or -1 if too many cells changed. out must hold
+// SNAPSHOT_MAXLEN + 1 bytes.
+int encodeDelta(const char *base, const char *snap, int len, char *out);
+
+// Turns the base snapshot in snap into the new one, returns its length or -1
+// if the delta is malformed. snap must hold SNAPSHOT_MAXLEN + 1 bytes.
+int applyDelta(char *snap, const char *delta, size_t len);
+
+#endif /* __GAME_H__ */
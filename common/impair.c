@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "impair.h"
+
+// One way figures, so a round trip costs twice the delay
+const char *impairProfiles[][2] = {
+    {"lan", "delay=1,jitter=1"},
+    {"wifi", "delay=3,jitter=10,loss=0.5,rate=50000"},
+    {"4g", "delay=35,jitter=25,loss=1,rate=10000,reorder=0.5"},
+    {"3g", "delay=100,jitter=60,loss=3,rate=1500,reorder=1"},
+    {"transatlantic", "delay=45,jitter=3,loss=0.2"},
+    {"satellite", "delay=300,jitter=20,loss=1,rate=2000"},
+    {NULL, NULL}
+};
+
+// Retransmission timeout a lost stream segment waits for (Linux's minimum)
+#define IMPAIR_RTO 200
+
+long impairNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool parseSpec(Impair *im, const char *spec, int depth)
+{
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *save;
+    for (char *opt = strtok_r(copy, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char name[16];
+        double value;
+        if (strchr(opt, '=') == NULL) {
+            int i = 0;
+            while (impairProfiles[i][0] != NULL && strcmp(impairProfiles[i][0], opt) != 0)
+                i++;
+            if (impairProfiles[i][0] == NULL || depth > 0 || !parseSpec(im, impairProfiles[i][1], 1))
+                return false;
+            continue;
+        }
+        if (sscanf(opt, "%15[a-z]=%lf", name, &value) != 2 || value < 0)
+            return false;
+        if (strcmp(name, "loss") == 0 && value <= 100)
+            im->loss = value;
+        else if (strcmp(name, "delay") == 0)
+            im->delay = value;
+        else if (strcmp(name, "jitter") == 0)
+            im->jitter = value;
+        else if (strcmp(name, "rate") == 0)
+            im->rate = value;
+        else if (strcmp(name, "reorder") == 0 && value <= 100)
+            im->reorder = value;
+        else if (strcmp(name, "seed") == 0)
+            im->seed = value;
+        else
+            return false;
+    }
+    return true;
+}
+
+bool initImpair(Impair *im, const char *spec)
+{
+    memset(im, 0, sizeof(*im));
+    im->seed = 1;
+    pthread_mutex_init(&im->lock, NULL);
+    return parseSpec(im, spec, 0);
+}
+
+// True with the given percent chance
+static bool chance(Impair *im, double percent)
+{
+    return percent > 0 && rand_r(&im->seed) % 10000 < percent * 100;
+}
+
+static long schedule(Impair *im, size_t len, bool stream)
+{
+    long now = impairNow();
+    bool lost = chance(im, im->loss);
+    if (lost && !stream) {
+        im->dropped++;
+        return -1;
+    }
+    im->sent++;
+    im->bytes += len;
+
+    long due = now + im->delay + (im->jitter > 0 ? rand_r(&im->seed) % (im->jitter + 1) : 0);
+    // the link sends one packet at a time
+    if (im->rate > 0) {
+        if (im->linkFree < now)
+            im->linkFree = now;
+        im->linkFree += len * 8.0 / im->rate;
+        due += (long) im->linkFree - now;
+    }
+    if (lost)
+        due += IMPAIR_RTO + 2 * im->delay;
+    if (!stream && chance(im, im->reorder))
+        return now;
+    if (due < im->lastDue)
+        due = im->lastDue;
+    im->lastDue = due;
+    return due;
+}
+
+long impairSchedule(Impair *im, size_t len, bool stream)
+{
+    pthread_mutex_lock(&im->lock);
+    long due = schedule(im, len, stream);
+    pthread_mutex_unlock(&im->lock);
+    return due;
+}
+
+ssize_t impairSend(Impair *im, int fd, const void *buf, size_t len, const struct sockaddr *to,
+                   socklen_t tolen)
+{
+    if (im == NULL)
+        return sendto(fd, buf, len, 0, to, tolen);
+
+    pthread_mutex_lock(&im->lock);
+    long due = schedule(im, len, false);
+    if (due >= 0 && due > impairNow() && len <= IMPAIR_MAXDGRAM && im->count == IMPAIR_QUEUE) {
+        // a full queue drops like a router's
+        im->sent--;
+        im->dropped++;
+        due = -1;
+    }
+    if (due < 0) {
+        pthread_mutex_unlock(&im->lock);
+        return len;
+    }
+    if (due <= impairNow() || len > IMPAIR_MAXDGRAM) {
+        pthread_mutex_unlock(&im->lock);
+        return sendto(fd, buf, len, 0, to, tolen);
+    }
+
+    HeldDatagram *d = &im->held[im->count++];
+    d->due = due;
+    d->fd = fd;
+    d->tolen = to != NULL ? tolen : 0;
+    if (to != NULL)
+        memcpy(&d->to, to, tolen);
+    d->len = len;
+    memcpy(d->data, buf, len);
+    pthread_mutex_unlock(&im->lock);
+    return len;
+}
+
+int impairFlush(Impair *im)
+{
+    if (im == NULL)
+        return -1;
+
+    pthread_mutex_lock(&im->lock);
+    long now = impairNow();
+    long next = -1;
+    for (int i = 0; i < im->count;) {
+        HeldDatagram *d = &im->held[i];
+        if (d->due > now) {
+            if (next < 0 || d->due - now < next)
+                next = d->due - now;
+            i++;
+            continue;
+        }
+        sendto(d->fd, d->data, d->len, 0, d->tolen > 0 ? (struct sockaddr *) &d->to : NULL, d->tolen);
+        // keep the rest in order, they are due in order
+        memmove(d, d + 1, (--im->count - i) * sizeof(HeldDatagram));
+    }
+    pthread_mutex_unlock(&im->lock);
+    return next;
+}
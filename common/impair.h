@@ -0,0 +1,75 @@
+// Network impairment: loss, latency, jitter, a bandwidth cap and reordering,
+// to try the game over a bad network on one machine. Used on the datagrams
+// the client and server send (-I) and by proxy/ on everything between them.
+//
+// A spec is a profile name and/or options, e.g. "4g", "4g,loss=10" or
+// "loss=5,delay=80,jitter=20,rate=1000,reorder=2,seed=1":
+//   loss     percent of packets dropped (may have decimals)
+//   delay    ms each packet is held for, one way
+//   jitter   up to this many ms more, at random; order is kept
+//   rate     kbit/s the link sends at, packets queue behind each other
+//   reorder  percent of datagrams sent at once, ahead of those held
+//   seed     random seed, for runs that can be repeated
+#ifndef __IMPAIR_H__
+#define __IMPAIR_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define IMPAIR_QUEUE 256      // datagrams held at once, more are dropped
+#define IMPAIR_MAXDGRAM 1024  // longer ones are sent without delay
+
+typedef struct
+{
+    long due;                 // ms, CLOCK_MONOTONIC
+    int fd;
+    struct sockaddr_storage to;
+    socklen_t tolen;
+    size_t len;
+    char data[IMPAIR_MAXDGRAM];
+} HeldDatagram;
+
+// One direction of a link, shared by every thread that sends through it
+typedef struct
+{
+    double loss;
+    int delay;
+    int jitter;
+    int rate;
+    double reorder;
+    unsigned seed;
+    pthread_mutex_t lock;
+    long lastDue;             // packets that keep their order leave after this
+    double linkFree;          // ms, when the link has sent everything so far
+    HeldDatagram held[IMPAIR_QUEUE];
+    int count;
+    unsigned long sent;
+    unsigned long dropped;
+    unsigned long bytes;
+} Impair;
+
+// Returns false if spec is malformed
+bool initImpair(Impair *im, const char *spec);
+
+// Profile names and the options they stand for, NULL-terminated
+extern const char *impairProfiles[][2];
+
+// When a packet of len bytes handed over now arrives (ms, CLOCK_MONOTONIC),
+// or -1 if it is lost. Bytes of a stream are never lost or reordered, a loss
+// delays them by a retransmission timeout instead.
+long impairSchedule(Impair *im, size_t len, bool stream);
+
+// Send buf now, later or never; to is NULL on a connected socket. With a NULL
+// im it is a plain send. Returns len unless the send itself fails.
+ssize_t impairSend(Impair *im, int fd, const void *buf, size_t len, const struct sockaddr *to,
+                   socklen_t tolen);
+
+// Send the held datagrams that are due. Returns the ms until the next one is,
+// or -1 if none are held.
+int impairFlush(Impair *im);
+
+long impairNow(void);
+
+#endif /* __IMPAIR_H__ */
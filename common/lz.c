@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASHBITS 12
+#define LZ_MAXOFFSET 65535
+
+static unsigned hash4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+// A length past the nibble as bytes of 255 and the remainder
+static unsigned char *putLength(unsigned char *op, const unsigned char *end, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op == end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == end)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+static unsigned char *putSequence(unsigned char *op, const unsigned char *end, const unsigned char *lit,
+                                  int litLen, int offset, int matchLen)
+{
+    if (op == end)
+        return NULL;
+    unsigned char *token = op++;
+    *token = (litLen < 15 ? litLen : 15) << 4;
+    if (litLen >= 15 && (op = putLength(op, end, litLen - 15)) == NULL)
+        return NULL;
+    if (end - op < litLen)
+        return NULL;
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (matchLen == 0)
+        return op;
+
+    if (end - op < 2)
+        return NULL;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    matchLen -= LZ_MINMATCH;
+    *token |= matchLen < 15 ? matchLen : 15;
+    if (matchLen >= 15 && (op = putLength(op, end, matchLen - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+int lzCompress(const unsigned char *in, int len, unsigned char *out, int cap)
+{
+    int table[1 << LZ_HASHBITS];
+    memset(table, 0xff, sizeof(table));
+    const unsigned char *end = out + cap;
+    unsigned char *op = out;
+    int anchor = 0;
+    int i = 0;
+    while (i + LZ_MINMATCH <= len) {
+        unsigned h = hash4(in + i);
+        int candidate = table[h];
+        table[h] = i;
+        if (candidate < 0 || i - candidate > LZ_MAXOFFSET || memcmp(in + candidate, in + i, LZ_MINMATCH) != 0) {
+            i++;
+            continue;
+        }
+        int matchLen = LZ_MINMATCH;
+        while (i + matchLen < len && in[candidate + matchLen] == in[i + matchLen])
+            matchLen++;
+        op = putSequence(op, end, in + anchor, i - anchor, i - candidate, matchLen);
+        if (op == NULL)
+            return -1;
+        i += matchLen;
+        anchor = i;
+    }
+    op = putSequence(op, end, in + anchor, len - anchor, 0, 0);
+    return op != NULL ? op - out : -1;
+}
+
+// Reads a length continued past its nibble, -1 if in runs out
+static int getLength(const unsigned char **ip, const unsigned char *end)
+{
+    int len = 0;
+    unsigned char b;
+    do {
+        if (*ip == end)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lzDecompress(const unsigned char *in, int len, unsigned char *out, int cap)
+{
+    const unsigned char *ip = in;
+    const unsigned char *end = in + len;
+    int o = 0;
+    while (ip < end) {
+        unsigned char token = *ip++;
+        int litLen = token >> 4;
+        if (litLen == 15) {
+            int more = getLength(&ip, end);
+            if (more < 0)
+                return -1;
+            litLen += more;
+        }
+        if (end - ip < litLen || cap - o < litLen)
+            return -1;
+        memcpy(out + o, ip, litLen);
+        ip += litLen;
+        o += litLen;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15) {
+            int more = getLength(&ip, end);
+            if (more < 0)
+                return -1;
+            matchLen += more;
+        }
+        matchLen += LZ_MINMATCH;
+        if (offset == 0 || offset > o || cap - o < matchLen)
+            return -1;
+        // byte by byte, the match may overlap what it is copying
+        for (int k = 0; k < matchLen; k++, o++)
+            out[o] = out[o - offset];
+    }
+    return o;
+}
@@ -0,0 +1,19 @@
+// Small LZ77 byte codec in the style of an LZ4 block: no entropy stage, so
+// both directions run at memory speed. Each sequence is a token byte (literal
+// count in the high nibble, match length - LZ_MINMATCH in the low one, 15
+// meaning more follows in bytes of up to 255), the literals, then a 2-byte
+// little endian match offset and the rest of the match length. The last
+// sequence is literals only.
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#define LZ_MINMATCH 4
+
+// Returns the compressed length, or -1 if it doesn't fit in cap
+int lzCompress(const unsigned char *in, int len, unsigned char *out, int cap);
+
+// Returns the decompressed length, or -1 if in is malformed or the result
+// doesn't fit in cap
+int lzDecompress(const unsigned char *in, int len, unsigned char *out, int cap);
+
+#endif /* __LZ_H__ */
@@ -0,0 +1,309 @@
+#include <string.h>
+
+#include "lz.h"
+#include "pack.h"
+
+static unsigned zigzag(int v)
+{
+    return ((unsigned) v << 1) ^ (unsigned) (v >> 31);
+}
+
+static int unzigzag(unsigned v)
+{
+    return (int) (v >> 1) ^ -(int) (v & 1);
+}
+
+static int varintLen(unsigned v)
+{
+    int n = 1;
+    for (; v >= 0x80; v >>= 7)
+        n++;
+    return n;
+}
+
+static unsigned char *putVarint(unsigned char *p, unsigned v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static int cellOf(Position pos)
+{
+    return pos.x * GRIDSIZE + pos.y;
+}
+
+// The bitplane as whichever coding is smallest, its kind added to flags
+static unsigned char *putGrid(unsigned char *p, unsigned char *flags, const bool *cells)
+{
+    int sparseLen = 0, runsLen = 0, count = 0;
+    int last = -1;  // last set cell
+    int runStart = 0;
+    for (int k = 0; k < PACK_CELLS; k++) {
+        if (cells[k]) {
+            sparseLen += varintLen(k - last - 1);
+            last = k;
+            count++;
+        }
+        if (k > 0 && cells[k] != cells[k - 1]) {
+            runsLen += varintLen(k - runStart);
+            runStart = k;
+        }
+    }
+    // a grid starting with a tomato starts with an empty run of grass
+    if (cells[0])
+        runsLen++;
+    sparseLen += varintLen(count);
+    int rawLen = (PACK_CELLS + 7) / 8;
+
+    if (runsLen <= sparseLen && runsLen < rawLen) {
+        *flags |= PACK_RUNS;
+        if (cells[0])
+            *p++ = 0;
+        runStart = 0;
+        for (int k = 1; k < PACK_CELLS; k++) {
+            if (cells[k] != cells[k - 1]) {
+                p = putVarint(p, k - runStart);
+                runStart = k;
+            }
+        }
+    }
+    else if (sparseLen < rawLen) {
+        *flags |= PACK_SPARSE;
+        p = putVarint(p, count);
+        last = -1;
+        for (int k = 0; k < PACK_CELLS; k++) {
+            if (cells[k]) {
+                p = putVarint(p, k - last - 1);
+                last = k;
+            }
+        }
+    }
+    else {
+        memset(p, 0, rawLen);
+        for (int k = 0; k < PACK_CELLS; k++)
+            p[k / 8] |= cells[k] << (k % 8);
+        p += rawLen;
+    }
+    return p;
+}
+
+int packSnapshot(const GameState *game, const GameState *base, bool lz, unsigned char *out)
+{
+    unsigned char flags = base != NULL ? PACK_DELTA : 0;
+    unsigned char *p = out + 1;
+    p = putVarint(p, zigzag(game->score - (base != NULL ? base->score : 0)));
+    p = putVarint(p, zigzag(game->level - (base != NULL ? base->level : 0)));
+    if (base == NULL || base->seed != game->seed) {
+        if (base != NULL)
+            flags |= PACK_SEED;
+        for (int i = 0; i < 4; i++)
+            *p++ = game->seed >> (8 * i);
+    }
+
+    unsigned char *present = p++;
+    unsigned char *moved = base != NULL ? p++ : NULL;
+    *present = 0;
+    if (moved != NULL)
+        *moved = 0;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        Position pos = game->playerPosition[i];
+        if (pos.x < 0)
+            continue;
+        *present |= 1 << i;
+        if (base == NULL) {
+            p = putVarint(p, cellOf(pos));
+            continue;
+        }
+        Position was = base->playerPosition[i];
+        if (was.x == pos.x && was.y == pos.y)
+            continue;
+        *moved |= 1 << i;
+        int dx = pos.x - was.x;
+        int dy = pos.y - was.y;
+        if (was.x >= 0 && dx > -8 && dx < 8 && dy > -8 && dy < 8)
+            *p++ = (dx + 8) << 4 | (dy + 8);
+        else {
+            *p++ = PACK_FAR;
+            p = putVarint(p, cellOf(pos));
+        }
+    }
+
+    bool cells[PACK_CELLS];
+    bool *cell = cells;
+    for (int x = 0; x < GRIDSIZE; x++) {
+        for (int y = 0; y < GRIDSIZE; y++) {
+            bool tomato = game->grid[x][y] == TILE_TOMATO;
+            *cell++ = base != NULL ? tomato != (base->grid[x][y] == TILE_TOMATO) : tomato;
+        }
+    }
+    p = putGrid(p, &flags, cells);
+    out[0] = flags;
+    int len = p - out;
+
+    if (lz && base == NULL) {
+        unsigned char packed[PACK_MAXLEN];
+        int n = lzCompress(out + 1, len - 1, packed, len - 2);
+        if (n > 0) {
+            out[0] |= PACK_LZ;
+            memcpy(out + 1, packed, n);
+            len = 1 + n;
+        }
+    }
+    return len;
+}
+
+// Untrusted bytes, ok turns false once a read runs past the end
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    bool ok;
+} Reader;
+
+static unsigned getByte(Reader *r)
+{
+    if (r->p == r->end) {
+        r->ok = false;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static unsigned getVarint(Reader *r)
+{
+    unsigned v = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        unsigned b = getByte(r);
+        v |= (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            // putVarint never ends on a zero byte, so these would only pad
+            if (b == 0 && shift > 0)
+                break;
+            return v;
+        }
+    }
+    r->ok = false;
+    return 0;
+}
+
+static bool getGrid(Reader *r, int coding, bool *cells)
+{
+    memset(cells, 0, PACK_CELLS * sizeof(bool));
+    if (coding == PACK_RAW) {
+        if (r->end - r->p != (PACK_CELLS + 7) / 8)
+            return false;
+        for (int k = 0; k < PACK_CELLS; k++)
+            cells[k] = (r->p[k / 8] >> (k % 8)) & 1;
+        return true;
+    }
+    if (coding == PACK_SPARSE) {
+        unsigned count = getVarint(r);
+        int k = -1;
+        for (unsigned i = 0; r->ok && i < count; i++) {
+            unsigned gap = getVarint(r);
+            if (gap >= (unsigned) (PACK_CELLS - 1 - k))
+                return false;
+            k += gap + 1;
+            cells[k] = true;
+        }
+        return r->ok && r->p == r->end;
+    }
+    if (coding == PACK_RUNS) {
+        int k = 0;
+        bool set = false;
+        // only the first run, of grass before a tomato in cell 0, can be empty
+        for (bool first = true; r->ok && r->p < r->end; first = false) {
+            unsigned run = getVarint(r);
+            if (run > (unsigned) (PACK_CELLS - k) || (run == 0 && !first))
+                return false;
+            for (; run > 0; run--)
+                cells[k++] = set;
+            set = !set;
+        }
+        while (k < PACK_CELLS)
+            cells[k++] = set;
+        return r->ok;
+    }
+    return false;
+}
+
+bool unpackSnapshot(const unsigned char *buf, size_t len, const GameState *base, GameState *game)
+{
+    if (len < 1)
+        return false;
+    unsigned flags = buf[0];
+    bool delta = flags & PACK_DELTA;
+    if ((flags & ~(PACK_CODING | PACK_DELTA | PACK_SEED | PACK_LZ)) != 0 || (delta && base == NULL) ||
+        (delta && (flags & PACK_LZ)) || (!delta && (flags & PACK_SEED)))
+        return false;
+
+    Reader r = {buf + 1, buf + len, true};
+    unsigned char plain[PACK_MAXLEN];
+    if (flags & PACK_LZ) {
+        int n = lzDecompress(buf + 1, len - 1, plain, sizeof(plain));
+        if (n < 0)
+            return false;
+        r = (Reader) {plain, plain + n, true};
+    }
+
+    GameState next;
+    next.score = unzigzag(getVarint(&r)) + (delta ? base->score : 0);
+    next.level = unzigzag(getVarint(&r)) + (delta ? base->level : 0);
+    if (!delta || (flags & PACK_SEED)) {
+        next.seed = 0;
+        for (int i = 0; i < 4; i++)
+            next.seed |= getByte(&r) << (8 * i);
+    }
+    else
+        next.seed = base->seed;
+
+    unsigned present = getByte(&r);
+    unsigned moved = delta ? getByte(&r) : 0;
+    if ((present >> MAX_PLAYERS) != 0 || (moved & ~present) != 0)
+        return false;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        Position *pos = &next.playerPosition[i];
+        Position was = delta ? base->playerPosition[i] : (Position) {-1, -1};
+        if (!(present & (1 << i))) {
+            *pos = (Position) {-1, -1};
+            continue;
+        }
+        if (delta && !(moved & (1 << i))) {
+            if (was.x < 0)
+                return false;
+            *pos = was;
+            continue;
+        }
+        unsigned b = delta ? getByte(&r) : PACK_FAR;
+        if (b != PACK_FAR) {
+            if (was.x < 0 || (b >> 4) == 0 || (b & 15) == 0)
+                return false;
+            *pos = (Position) {was.x + (int) (b >> 4) - 8, was.y + (int) (b & 15) - 8};
+            if (pos->x < 0 || pos->x >= GRIDSIZE || pos->y < 0 || pos->y >= GRIDSIZE)
+                return false;
+        }
+        else {
+            unsigned cell = getVarint(&r);
+            if (cell >= PACK_CELLS)
+                return false;
+            *pos = (Position) {cell / GRIDSIZE, cell % GRIDSIZE};
+        }
+    }
+
+    bool cells[PACK_CELLS];
+    if (!r.ok || !getGrid(&r, flags & PACK_CODING, cells))
+        return false;
+    next.numTomatoes = 0;
+    const bool *cell = cells;
+    for (int x = 0; x < GRIDSIZE; x++) {
+        for (int y = 0; y < GRIDSIZE; y++) {
+            bool tomato = *cell++ != (delta && base->grid[x][y] == TILE_TOMATO);
+            next.grid[x][y] = tomato ? TILE_TOMATO : TILE_GRASS;
+            next.numTomatoes += tomato;
+        }
+    }
+    *game = next;
+    return true;
+}
@@ -0,0 +1,48 @@
+// Compact binary snapshots, for clients that ask with "compact". The text
+// snapshot spends a byte per cell; here the grid is a tomato bitplane coded
+// whichever way is smallest, and a delta carries only what changed since a
+// base snapshot the client has:
+//   flags         1 byte, PACK_*; the grid coding in the low two bits
+//   score, level  zigzag varints, the change from the base in a delta
+//   seed          4 bytes, little endian; in a delta only with PACK_SEED
+//   players       1 byte, bit i set if player i is on the grid
+//                 keyframe: the cell of each one, as a varint
+//                 delta: then 1 byte, bit i set if player i moved; the cell of
+//                 each one that moved, as dx + 8 and dy + 8 in a byte if it
+//                 was on the grid already and moved less than 8 cells, else
+//                 PACK_FAR and a varint
+//   grid          the tomato bitplane, XORed with the base one in a delta:
+//                 PACK_RAW     a bit per cell, least significant first
+//                 PACK_SPARSE  the number of set cells, then the gap before
+//                              each one, as varints
+//                 PACK_RUNS    lengths of alternating runs of clear and set
+//                              cells, as varints, leaving out the last run
+// Cells are numbered column-major, x * GRIDSIZE + y, as in the text snapshot.
+// A keyframe with PACK_LZ has everything after the flags through lzCompress.
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include "game.h"
+
+#define PACK_RAW 0
+#define PACK_SPARSE 1
+#define PACK_RUNS 2
+#define PACK_CODING 3
+#define PACK_DELTA 4
+#define PACK_SEED 8
+#define PACK_LZ 16
+
+#define PACK_FAR 0x88 // dx = dy = 0 never moved, so it escapes to a cell index
+
+#define PACK_CELLS (GRIDSIZE * GRIDSIZE)
+#define PACK_MAXLEN (1 + 2 * 5 + 4 + 2 + MAX_PLAYERS * 4 + (PACK_CELLS + 7) / 8)
+
+// Encode game as a keyframe (base NULL) or as its changes since base.
+// Keyframes go through lzCompress when lz is set and that makes them smaller.
+// Returns the length, out must hold PACK_MAXLEN bytes.
+int packSnapshot(const GameState *game, const GameState *base, bool lz, unsigned char *out);
+
+// Returns false if buf is malformed, or a delta and base is NULL
+bool unpackSnapshot(const unsigned char *buf, size_t len, const GameState *base, GameState *game);
+
+#endif /* __PACK_H__ */
@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+
+// Map the file at size bytes, growing it first
+static bool remap(ReplayWriter *w, size_t size)
+{
+    if (w->map != NULL)
+        munmap(w->map, w->mapped);
+    w->map = NULL;
+    if (ftruncate(w->fd, size) < 0)
+        return false;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    w->map = map;
+    w->mapped = size;
+    return true;
+}
+
+bool openReplayWriter(ReplayWriter *w, const char *path, const GameState *start, int room)
+{
+    memset(w, 0, sizeof(*w));
+    if ((w->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+        return false;
+    if (!remap(w, REPLAY_CHUNK)) {
+        close(w->fd);
+        return false;
+    }
+
+    ReplayHeader *h = (ReplayHeader *) w->map;
+    h->magic = REPLAY_MAGIC;
+    h->version = REPLAY_VERSION;
+    h->room = room;
+    h->start = *start;
+    h->started = time(NULL);
+    w->used = sizeof(ReplayHeader);
+    return true;
+}
+
+bool writeReplay(ReplayWriter *w, uint32_t tick, REPLAYOP op, int player, int arg, uint32_t value)
+{
+    if (w->map == NULL)
+        return false;
+    if (w->used + sizeof(ReplayRecord) > w->mapped && !remap(w, w->mapped + REPLAY_CHUNK))
+        return false;
+
+    ReplayRecord *rec = (ReplayRecord *) (w->map + w->used);
+    rec->tick = tick;
+    rec->player = player;
+    rec->arg = arg;
+    rec->value = value;
+    // written last so a reader never sees a half-filled record as valid
+    rec->op = op;
+    w->used += sizeof(ReplayRecord);
+    return true;
+}
+
+bool closeReplayWriter(ReplayWriter *w)
+{
+    if (w->map != NULL)
+        munmap(w->map, w->mapped);
+    bool ok = ftruncate(w->fd, w->used) == 0;
+    close(w->fd);
+    w->map = NULL;
+    return ok;
+}
+
+bool openReplay(Replay *r, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ReplayHeader)) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    r->header = (const ReplayHeader *) map;
+    r->records = (const ReplayRecord *) (map + sizeof(ReplayHeader));
+    r->size = st.st_size;
+    if (r->header->magic != REPLAY_MAGIC || r->header->version != REPLAY_VERSION) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    // a log that wasn't closed still has the zero fill of its last chunk
+    size_t max = (st.st_size - sizeof(ReplayHeader)) / sizeof(ReplayRecord);
+    r->count = 0;
+    while (r->count < max && r->records[r->count].op != REPLAY_END)
+        r->count++;
+    return true;
+}
+
+void closeReplay(Replay *r)
+{
+    munmap((void *) r->header, r->size);
+}
+
+bool applyReplay(GameState *game, const ReplayRecord *rec)
+{
+    // a corrupt log must not take us outside the state
+    if (rec->player >= MAX_PLAYERS)
+        return false;
+    switch (rec->op) {
+    case REPLAY_JOIN:
+        spawnPlayer(game, rec->player);
+        break;
+    case REPLAY_LEAVE:
+    case REPLAY_SPECTATE:
+        despawnPlayer(game, rec->player);
+        break;
+    case REPLAY_MOVE:
+        if (rec->arg < DIR_UP || rec->arg > DIR_RIGHT)
+            return false;
+        movePlayer(game, rec->player, rec->arg);
+        break;
+    case REPLAY_LEVEL:
+        return (uint16_t) game->level == rec->arg && game->seed == rec->value;
+    case REPLAY_CHECK:
+        return replayChecksum(game) == rec->value;
+    }
+    return true;
+}
+
+// FNV-1a over the fields, one at a time so padding doesn't count
+static uint32_t fnv(uint32_t h, uint32_t v)
+{
+    for (int i = 0; i < 4; i++, v >>= 8)
+        h = (h ^ (v & 0xff)) * 16777619u;
+    return h;
+}
+
+uint32_t replayChecksum(const GameState *game)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < GRIDSIZE; i++) {
+        for (int j = 0; j < GRIDSIZE; j++)
+            h = fnv(h, game->grid[i][j]);
+    }
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        h = fnv(h, game->playerPosition[i].x);
+        h = fnv(h, game->playerPosition[i].y);
+    }
+    h = fnv(h, game->score);
+    h = fnv(h, game->level);
+    return fnv(h, game->seed);
+}
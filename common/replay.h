@@ -0,0 +1,87 @@
+// Replay logs: every input a room accepted, appended to a file through mmap so
+// recording costs a 12-byte copy. Re-applying the records to the game stored
+// in the header rebuilds its state at any tick.
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+#include "game.h"
+
+#define REPLAY_MAGIC 0x4c524354 // "TCRL"
+#define REPLAY_VERSION 2
+
+// The starting state is stored whole rather than as a seed, as a room may
+// have been restored mid-game; it is in the native GameState layout
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t room;
+    uint32_t reserved;
+    uint64_t started;   // wall clock, seconds
+    GameState start;
+} ReplayHeader;
+
+typedef enum
+{
+    REPLAY_END,         // zero fill after the last record
+    REPLAY_JOIN,        // player spawned
+    REPLAY_LEAVE,       // player left the game
+    REPLAY_MOVE,        // arg: DIRECTION
+    REPLAY_SPECTATE,    // player left the grid but stayed connected
+    REPLAY_LEVEL,       // arg: the level reached, value: the seed after drawing it
+    REPLAY_CHECK        // value: replayChecksum() of the state at this point
+} REPLAYOP;
+
+// Records with tick T were applied before the room's snapshot number T went out
+typedef struct
+{
+    uint32_t tick;
+    uint8_t op;
+    uint8_t player;
+    uint16_t arg;
+    uint32_t value;
+} ReplayRecord;
+
+typedef struct
+{
+    int fd;
+    char *map;
+    size_t mapped;      // file size, grown in REPLAY_CHUNK steps
+    size_t used;
+} ReplayWriter;
+
+#define REPLAY_CHUNK (1 << 20)
+
+// Create path and write the header, false on error (EEXIST if there is a
+// file at path, which is never overwritten)
+bool openReplayWriter(ReplayWriter *w, const char *path, const GameState *start, int room);
+
+// Append a record, false if the file could not grow
+bool writeReplay(ReplayWriter *w, uint32_t tick, REPLAYOP op, int player, int arg, uint32_t value);
+
+// Cut the file to the records written and close it. False if it couldn't be
+// cut, errno set; the zero fill past the end still reads as REPLAY_END.
+bool closeReplayWriter(ReplayWriter *w);
+
+typedef struct
+{
+    const ReplayHeader *header;
+    const ReplayRecord *records;
+    size_t count;
+    size_t size;        // of the mapping
+} Replay;
+
+// Map a log read-only, false if it can't be opened or isn't a replay log
+bool openReplay(Replay *r, const char *path);
+void closeReplay(Replay *r);
+
+// Apply one record. Returns false if the game diverged from the recording
+// (a level or check record that doesn't match) or the record is corrupt.
+bool applyReplay(GameState *game, const ReplayRecord *rec);
+
+// Hash of everything a replay must reproduce: grid, players, score, level, seed
+uint32_t replayChecksum(const GameState *game);
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,383 @@
+// Impairing proxy: clients connect to it instead of the server and everything
+// between them crosses a simulated network (common/impair.h), so prediction,
+// interpolation and the transports can be tried under latency and loss on one
+// machine, the same way every run.
+//
+//   proxy [-I impairment] [-D impairment] [-u ports] [-t seconds] listen_port host port
+//     -I  both directions, "lan" by default
+//     -D  server to client only, if it differs
+//     -u  also forward the datagram ports after listen_port to those after
+//         port, as many as the server has shards
+//     -t  quit after that many seconds
+//   proxy -l
+//     lists the profiles
+//
+// TCP bytes are delayed and paced but never lost; a loss stalls the stream
+// for a retransmission timeout. Datagrams are dropped, delayed and reordered.
+#include <poll.h>
+
+#include "csapp.h"
+#include "impair.h"
+
+#define PROXY_MAXFLOWS 64
+#define PROXY_CHUNK 4096
+#define PROXY_BUFFERED (256 * 1024) // bytes held per direction before reading stops
+#define PROXY_MAXUDP 16
+#define PROXY_SESSIONS 64
+#define SESSION_IDLE 60000          // ms without datagrams before a session is forgotten
+
+// Bytes read in one go, held until they are due at the other end
+typedef struct Chunk
+{
+    long due;
+    size_t len;
+    size_t sent;
+    struct Chunk *next;
+    char data[];
+} Chunk;
+
+// One direction of a connection
+typedef struct
+{
+    int from;
+    int to;
+    Chunk *head;
+    Chunk *tail;
+    size_t buffered;
+    bool eof;       // from hung up; to is shut down once the rest is written
+    bool shut;
+    bool broken;
+    Impair *im;
+} Pipe;
+
+typedef struct
+{
+    bool open;
+    Pipe pipe[2];   // client to server, server to client
+} Flow;
+
+// A client's datagrams on one port, forwarded from a socket of their own so
+// the replies can be told apart
+typedef struct
+{
+    bool open;
+    int port;       // index in udpfds
+    struct sockaddr_storage client;
+    socklen_t clientlen;
+    int fd;         // connected to the server
+    long lastSeen;
+} Session;
+
+static Impair up, down;
+static Flow flows[PROXY_MAXFLOWS];
+static Session sessions[PROXY_SESSIONS];
+static int udpfds[PROXY_MAXUDP];
+static int udpPorts;
+static char *serverHost, *serverPort;
+static struct sockaddr_storage serverAddr; // from the first connection, for datagrams
+static socklen_t serverAddrLen;
+static volatile sig_atomic_t stop;
+
+static void nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void closeFlow(Flow *f)
+{
+    for (int i = 0; i < 2; i++) {
+        Pipe *p = &f->pipe[i];
+        while (p->head != NULL) {
+            Chunk *next = p->head->next;
+            Free(p->head);
+            p->head = next;
+        }
+        close(p->from);
+    }
+    memset(f, 0, sizeof(*f));
+}
+
+static void openFlow(int listenfd)
+{
+    int clientfd = accept(listenfd, NULL, NULL);
+    if (clientfd < 0)
+        return;
+    int i = 0;
+    while (i < PROXY_MAXFLOWS && flows[i].open)
+        i++;
+    int serverfd = i < PROXY_MAXFLOWS ? open_clientfd(serverHost, serverPort) : -1;
+    if (serverfd < 0) {
+        close(clientfd);
+        return;
+    }
+    if (serverAddrLen == 0) {
+        serverAddrLen = sizeof(serverAddr);
+        getpeername(serverfd, (SA *) &serverAddr, &serverAddrLen);
+    }
+    nonblocking(clientfd);
+    nonblocking(serverfd);
+    Flow *f = &flows[i];
+    f->open = true;
+    f->pipe[0] = (Pipe) {.from = clientfd, .to = serverfd, .im = &up};
+    f->pipe[1] = (Pipe) {.from = serverfd, .to = clientfd, .im = &down};
+}
+
+// Returns false if the connection broke
+static bool readPipe(Pipe *p)
+{
+    Chunk *c = Malloc(sizeof(Chunk) + PROXY_CHUNK);
+    ssize_t n = read(p->from, c->data, PROXY_CHUNK);
+    if (n <= 0) {
+        Free(c);
+        p->eof = n == 0;
+        return n == 0 || errno == EAGAIN || errno == EINTR;
+    }
+    c->len = n;
+    c->sent = 0;
+    c->next = NULL;
+    c->due = impairSchedule(p->im, n, true);
+    if (p->tail != NULL)
+        p->tail->next = c;
+    else
+        p->head = c;
+    p->tail = c;
+    p->buffered += n;
+    return true;
+}
+
+// Write what is due; returns false if the connection broke
+static bool writePipe(Pipe *p, long now)
+{
+    while (p->head != NULL && p->head->due <= now) {
+        Chunk *c = p->head;
+        ssize_t n = write(p->to, c->data + c->sent, c->len - c->sent);
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR;
+        c->sent += n;
+        p->buffered -= n;
+        if (c->sent < c->len)
+            return true;
+        p->head = c->next;
+        if (p->head == NULL)
+            p->tail = NULL;
+        Free(c);
+    }
+    if (p->eof && p->head == NULL && !p->shut) {
+        shutdown(p->to, SHUT_WR);
+        p->shut = true;
+    }
+    return true;
+}
+
+static Session *findSession(int port, struct sockaddr_storage *addr, socklen_t len, long now)
+{
+    Session *free = NULL;
+    for (int i = 0; i < PROXY_SESSIONS; i++) {
+        Session *s = &sessions[i];
+        if (s->open && now - s->lastSeen > SESSION_IDLE) {
+            close(s->fd);
+            s->open = false;
+        }
+        if (s->open && s->port == port && s->clientlen == len && memcmp(&s->client, addr, len) == 0)
+            return s;
+        if (!s->open && free == NULL)
+            free = s;
+    }
+    // the server's datagram ports follow its TCP port, like ours
+    if (free == NULL || serverAddrLen == 0)
+        return NULL;
+    struct sockaddr_storage to = serverAddr;
+    if (to.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &to;
+        in6->sin6_port = htons(ntohs(in6->sin6_port) + 1 + port);
+    }
+    else {
+        struct sockaddr_in *in = (struct sockaddr_in *) &to;
+        in->sin_port = htons(ntohs(in->sin_port) + 1 + port);
+    }
+    int fd = socket(to.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (SA *) &to, serverAddrLen) < 0) {
+        close(fd);
+        return NULL;
+    }
+    nonblocking(fd);
+    free->open = true;
+    free->port = port;
+    free->client = *addr;
+    free->clientlen = len;
+    free->fd = fd;
+    return free;
+}
+
+static void forwardUp(int port, long now)
+{
+    char buf[2048];
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    ssize_t n;
+    while ((n = recvfrom(udpfds[port], buf, sizeof(buf), 0, (SA *) &addr, &len)) >= 0) {
+        Session *s = findSession(port, &addr, len, now);
+        if (s != NULL) {
+            s->lastSeen = now;
+            impairSend(&up, s->fd, buf, n, NULL, 0);
+        }
+        len = sizeof(addr);
+    }
+}
+
+static void forwardDown(Session *s)
+{
+    char buf[2048];
+    ssize_t n;
+    while ((n = recv(s->fd, buf, sizeof(buf), 0)) >= 0)
+        impairSend(&down, udpfds[s->port], buf, n, (SA *) &s->client, s->clientlen);
+}
+
+static void run(int listenfd)
+{
+    struct pollfd fds[1 + PROXY_MAXUDP + PROXY_SESSIONS + 2 * PROXY_MAXFLOWS];
+    // what each polled fd is for, past the listening sockets
+    Session *sessionOf[sizeof(fds) / sizeof(fds[0])];
+    Pipe *pipeOf[sizeof(fds) / sizeof(fds[0])];
+    while (!stop) {
+        long now = impairNow();
+        long timeout = -1;
+        int n = 0;
+        fds[n++] = (struct pollfd) {.fd = listenfd, .events = POLLIN};
+        for (int i = 0; i < udpPorts; i++)
+            fds[n++] = (struct pollfd) {.fd = udpfds[i], .events = POLLIN};
+        for (int i = 0; i < PROXY_SESSIONS; i++) {
+            if (sessions[i].open) {
+                sessionOf[n] = &sessions[i];
+                pipeOf[n] = NULL;
+                fds[n++] = (struct pollfd) {.fd = sessions[i].fd, .events = POLLIN};
+            }
+        }
+        for (int i = 0; i < PROXY_MAXFLOWS; i++) {
+            for (int j = 0; flows[i].open && j < 2; j++) {
+                Pipe *p = &flows[i].pipe[j];
+                Pipe *back = &flows[i].pipe[1 - j];
+                short events = 0;
+                if (!p->eof && p->buffered < PROXY_BUFFERED)
+                    events |= POLLIN;
+                // back writes to the same fd p reads from
+                if (back->head != NULL && back->head->due <= now)
+                    events |= POLLOUT;
+                else if (back->head != NULL && (timeout < 0 || back->head->due - now < timeout))
+                    timeout = back->head->due - now;
+                sessionOf[n] = NULL;
+                pipeOf[n] = p;
+                fds[n++] = (struct pollfd) {.fd = p->from, .events = events};
+            }
+        }
+        int held[2] = {impairFlush(&up), impairFlush(&down)};
+        for (int i = 0; i < 2; i++) {
+            if (held[i] >= 0 && (timeout < 0 || held[i] < timeout))
+                timeout = held[i];
+        }
+
+        if (poll(fds, n, timeout) < 0)
+            continue;
+        now = impairNow();
+        if (fds[0].revents & POLLIN)
+            openFlow(listenfd);
+        for (int i = 0; i < udpPorts; i++) {
+            if (fds[1 + i].revents & POLLIN)
+                forwardUp(i, now);
+        }
+        for (int i = 1 + udpPorts; i < n; i++) {
+            if (sessionOf[i] != NULL && (fds[i].revents & POLLIN))
+                forwardDown(sessionOf[i]);
+            if (pipeOf[i] != NULL && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !readPipe(pipeOf[i]))
+                pipeOf[i]->broken = true;
+        }
+        // write whatever fell due, whether or not its fd polled ready
+        for (int i = 0; i < PROXY_MAXFLOWS; i++) {
+            Flow *f = &flows[i];
+            if (!f->open)
+                continue;
+            bool ok = !f->pipe[0].broken && !f->pipe[1].broken;
+            for (int j = 0; ok && j < 2; j++)
+                ok = writePipe(&f->pipe[j], now);
+            if (!ok || (f->pipe[0].shut && f->pipe[1].shut))
+                closeFlow(f);
+        }
+    }
+}
+
+static void printDirection(const char *name, const Impair *im)
+{
+    printf("%s: %lu packets, %lu bytes, %lu dropped, %d held\n", name, im->sent, im->bytes, im->dropped,
+           im->count);
+}
+
+static void quit(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    char *spec = "lan";
+    char *downSpec = NULL;
+    int seconds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "I:D:u:t:l")) != -1) {
+        if (opt == 'I')
+            spec = optarg;
+        else if (opt == 'D')
+            downSpec = optarg;
+        else if (opt == 'u' && atoi(optarg) >= 0 && atoi(optarg) <= PROXY_MAXUDP)
+            udpPorts = atoi(optarg);
+        else if (opt == 't' && atoi(optarg) > 0)
+            seconds = atoi(optarg);
+        else if (opt == 'l') {
+            for (int i = 0; impairProfiles[i][0] != NULL; i++)
+                printf("%-14s %s\n", impairProfiles[i][0], impairProfiles[i][1]);
+            return 0;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "usage: %s [-I impairment] [-D impairment] [-u ports] [-t seconds] "
+                "<listen port> <host> <port>\n       %s -l\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (!initImpair(&up, spec) || !initImpair(&down, downSpec != NULL ? downSpec : spec)) {
+        fprintf(stderr, "bad impairment, see %s -l and common/impair.h\n", argv[0]);
+        return 1;
+    }
+    // the two directions draw different numbers from the same seed
+    down.seed = ~down.seed;
+    serverHost = argv[optind + 1];
+    serverPort = argv[optind + 2];
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = quit;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    if (seconds > 0)
+        alarm(seconds);
+
+    int listenfd = Open_listenfd(argv[optind]);
+    nonblocking(listenfd);
+    for (int i = 0; i < udpPorts; i++) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", atoi(argv[optind]) + 1 + i);
+        udpfds[i] = Open_datagramfd(port);
+        nonblocking(udpfds[i]);
+    }
+    run(listenfd);
+
+    printDirection("client -> server", &up);
+    printDirection("server -> client", &down);
+    return 0;
+}
@@ -0,0 +1,187 @@
+// Rebuild rooms from their replay logs.
+//
+//   replay [-t tick] log
+//     applies every record up to snapshot number tick (by default all of
+//     them) and prints the resulting game
+//   replay -c [-j threads] [-n runs] log...
+//     re-simulates every log runs times on a pool of threads, as fast as the
+//     game code goes, checks each against its recorded checkpoints and
+//     reports the simulation throughput
+#include "csapp.h"
+#include "game.h"
+#include "replay.h"
+
+typedef struct
+{
+    const char *path;
+    Replay replay;
+    bool ok;
+    size_t failedAt;        // record that didn't match, if !ok
+    GameState end;
+} Job;
+
+static Job *jobs;
+static int jobCount;
+static int runs = 1;
+static int nextRun;         // taken atomically by the workers
+
+// Apply up to count records, returns the number applied before a mismatch
+// and adds the moves among them to *moves
+static size_t simulate(const Replay *r, size_t count, GameState *game, unsigned long *moves)
+{
+    *game = r->header->start;
+    unsigned long n = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        const ReplayRecord *rec = &r->records[i];
+        n += rec->op == REPLAY_MOVE;
+        if (!applyReplay(game, rec))
+            break;
+    }
+    *moves += n;
+    return i;
+}
+
+// Counts its moves locally and stores them once: the workers' slots share
+// cache lines
+static void *worker(void *vargp)
+{
+    unsigned long moves = 0;
+    int run;
+    while ((run = __atomic_fetch_add(&nextRun, 1, __ATOMIC_RELAXED)) < jobCount * runs) {
+        Job *job = &jobs[run % jobCount];
+        GameState game;
+        size_t applied = simulate(&job->replay, job->replay.count, &game, &moves);
+        // every run of a log comes out the same, the first one reports
+        if (run < jobCount) {
+            job->ok = applied == job->replay.count;
+            job->failedAt = applied;
+            job->end = game;
+        }
+    }
+    *(unsigned long *) vargp = moves;
+    return NULL;
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(char **paths, int count, int threads)
+{
+    jobs = Malloc(count * sizeof(Job));
+    memset(jobs, 0, count * sizeof(Job));
+    for (int i = 0; i < count; i++) {
+        Job *job = &jobs[jobCount];
+        job->path = paths[i];
+        if (!openReplay(&job->replay, paths[i])) {
+            fprintf(stderr, "%s: not a replay log\n", paths[i]);
+            continue;
+        }
+        jobCount++;
+    }
+    if (jobCount == 0)
+        return 1;
+
+    pthread_t *tids = Malloc(threads * sizeof(pthread_t));
+    unsigned long *moves = Malloc(threads * sizeof(unsigned long));
+    double start = seconds();
+    for (int i = 0; i < threads; i++) {
+        moves[i] = 0;
+        Pthread_create(&tids[i], NULL, worker, &moves[i]);
+    }
+    unsigned long total = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += moves[i];
+    }
+    double elapsed = seconds() - start;
+
+    int failed = 0;
+    for (int i = 0; i < jobCount; i++) {
+        Job *job = &jobs[i];
+        if (job->ok) {
+            printf("%s: %zu records, score %d, level %d, ok\n", job->path, job->replay.count,
+                   job->end.score, job->end.level);
+            continue;
+        }
+        const ReplayRecord *rec = &job->replay.records[job->failedAt];
+        printf("%s: diverged at record %zu (tick %u)\n", job->path, job->failedAt, rec->tick);
+        failed++;
+    }
+    printf("%d logs x %d runs on %d threads: %lu moves in %.3f s, %.0f moves/s, %.0f moves/s/core\n",
+           jobCount, runs, threads, total, elapsed, total / elapsed, total / elapsed / threads);
+
+    for (int i = 0; i < jobCount; i++)
+        closeReplay(&jobs[i].replay);
+    Free(jobs);
+    Free(tids);
+    Free(moves);
+    return failed ? 2 : 0;
+}
+
+static int inspect(const char *path, long tick)
+{
+    Replay r;
+    if (!openReplay(&r, path)) {
+        fprintf(stderr, "%s: not a replay log\n", path);
+        return 1;
+    }
+
+    size_t count = 0;
+    while (count < r.count && (tick < 0 || r.records[count].tick <= tick))
+        count++;
+    GameState game;
+    unsigned long moves = 0;
+    size_t applied = simulate(&r, count, &game, &moves);
+    if (applied < count) {
+        const ReplayRecord *rec = &r.records[applied];
+        fprintf(stderr, "diverged at record %zu (tick %u)\n", applied, rec->tick);
+        return 2;
+    }
+
+    unsigned last = r.count > 0 ? r.records[r.count - 1].tick : 0;
+    printf("room %u, level %d, seed %u, %zu records over %u ticks\n", r.header->room, r.header->start.level,
+           r.header->start.seed, r.count, last + 1);
+    printf("after %zu records: score %d, level %d\n", applied, game.score, game.level);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (game.playerPosition[i].x >= 0)
+            printf("player %d at (%d, %d)\n", i, game.playerPosition[i].x, game.playerPosition[i].y);
+    }
+    printGrid(&game);
+    closeReplay(&r);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long tick = -1;
+    bool checking = false;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:cj:n:")) != -1) {
+        if (opt == 't')
+            tick = atol(optarg);
+        else if (opt == 'c')
+            checking = true;
+        else if (opt == 'j' && atoi(optarg) > 0)
+            threads = atoi(optarg);
+        else if (opt == 'n' && atoi(optarg) > 0)
+            runs = atoi(optarg);
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (checking ? argc - optind < 1 : argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-t tick] <replay log>\n"
+                "       %s -c [-j threads] [-n runs] <replay log>...\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (checking)
+        return check(argv + optind, argc - optind, threads);
+    return inspect(argv[optind], tick);
+}
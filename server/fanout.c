@@ -0,0 +1,322 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "fanout.h"
+
+// Encoded frames, written to every viewer that is sent them. Only the fanout
+// thread touches refs once a frame is published.
+typedef struct
+{
+	int refs;
+	unsigned tick;
+	size_t len;
+	char data[];
+} Frame;
+
+typedef struct Viewer
+{
+	int fd;		// -1 once closed, freed at the end of the batch
+	int room;
+	int index;	// in its room's list
+	bool hasTick;	// lastTick was queued, a delta from it can follow
+	unsigned lastTick;
+	bool waiting;	// the socket is full, EPOLLOUT is on
+	Frame *queue[FANOUT_QUEUE];
+	int head;
+	int count;
+	size_t sent;	// bytes of queue[head] written
+	struct Viewer *nextClosed;
+} Viewer;
+
+typedef struct
+{
+	Viewer **viewers;
+	int count;
+	int size;
+	Frame *key;	// the newest keyframe, for viewers that just arrived
+} RoomViewers;
+
+// Inbox entries, pushed by any thread: a new viewer or a publication
+typedef struct Message
+{
+	struct Message *next;
+	int fd;		// -1 for a publication
+	int room;
+	Frame *key;
+	Frame *delta;
+} Message;
+
+static RoomViewers *roomViewerLists;
+static int *viewerCounts;	// per room, updated atomically
+static int *waitingRooms;	// per room, set atomically by watchRoom for the first viewer
+static Message *inbox;		// lock-free stack
+static int epfd, wakefd;
+static volatile sig_atomic_t stopping;
+static pthread_t tid;
+static Viewer *closedViewers;	// freed after the events of a batch
+
+static unsigned long framesQueued, framesDropped, keyframes, peakViewers, viewersNow;
+
+static Frame *newFrame(unsigned tick, const void *data, size_t len)
+{
+	Frame *f = Malloc(sizeof(Frame) + len);
+	f->refs = 1;
+	f->tick = tick;
+	f->len = len;
+	memcpy(f->data, data, len);
+	return f;
+}
+
+static void unref(Frame *f)
+{
+	if (f != NULL && --f->refs == 0)
+		Free(f);
+}
+
+static void push(Message *m)
+{
+	m->next = __atomic_load_n(&inbox, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&inbox, &m->next, m, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	uint64_t one = 1;
+	write(wakefd, &one, sizeof(one));
+}
+
+static void closeViewer(Viewer *v)
+{
+	if (v->fd < 0)
+		return;
+	RoomViewers *r = &roomViewerLists[v->room];
+	r->viewers[v->index] = r->viewers[--r->count];
+	r->viewers[v->index]->index = v->index;
+	for (int i = 0; i < v->count; i++)
+		unref(v->queue[(v->head + i) % FANOUT_QUEUE]);
+	close(v->fd);
+	v->fd = -1;
+	__atomic_fetch_sub(&viewerCounts[v->room], 1, __ATOMIC_RELAXED);
+	viewersNow--;
+	v->nextClosed = closedViewers;
+	closedViewers = v;
+}
+
+// Write what the kernel takes, then wait for EPOLLOUT if anything is left
+static void flushViewer(Viewer *v)
+{
+	struct iovec iov[FANOUT_QUEUE];
+	for (int i = 0; i < v->count; i++) {
+		Frame *f = v->queue[(v->head + i) % FANOUT_QUEUE];
+		size_t skip = i == 0 ? v->sent : 0;
+		iov[i].iov_base = f->data + skip;
+		iov[i].iov_len = f->len - skip;
+	}
+	ssize_t n = v->count > 0 ? writev(v->fd, iov, v->count) : 0;
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		closeViewer(v);
+		return;
+	}
+	size_t done = n > 0 ? n : 0;
+	while (v->count > 0) {
+		Frame *f = v->queue[v->head];
+		size_t left = f->len - v->sent;
+		if (done < left) {
+			v->sent += done;
+			break;
+		}
+		done -= left;
+		unref(f);
+		v->sent = 0;
+		v->head = (v->head + 1) % FANOUT_QUEUE;
+		v->count--;
+	}
+	bool waiting = v->count > 0;
+	if (waiting != v->waiting) {
+		struct epoll_event ev = {.events = EPOLLIN | (waiting ? EPOLLOUT : 0), .data.ptr = v};
+		epoll_ctl(epfd, EPOLL_CTL_MOD, v->fd, &ev);
+		v->waiting = waiting;
+	}
+}
+
+// Queue the delta if the viewer has its base, the keyframe otherwise. A
+// viewer whose queue is full misses the frame and gets a keyframe once it
+// has caught up.
+static void deliver(Viewer *v, Frame *key, Frame *delta)
+{
+	if (v->hasTick && (int) (key->tick - v->lastTick) <= 0)
+		return;
+	if (v->count == FANOUT_QUEUE) {
+		framesDropped++;
+		return;
+	}
+	Frame *f = delta != NULL && v->hasTick && v->lastTick == delta->tick - 1 ? delta : key;
+	keyframes += f == key;
+	framesQueued++;
+	f->refs++;
+	v->queue[(v->head + v->count++) % FANOUT_QUEUE] = f;
+	v->hasTick = true;
+	v->lastTick = f->tick;
+	if (!v->waiting)
+		flushViewer(v);
+}
+
+static void addViewer(int fd, int room)
+{
+	RoomViewers *r = &roomViewerLists[room];
+	Viewer *v = Malloc(sizeof(Viewer));
+	memset(v, 0, sizeof(*v));
+	v->fd = fd;
+	v->room = room;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = v};
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (r->count == r->size) {
+		r->size = r->size > 0 ? 2 * r->size : 16;
+		Viewer **grown = Malloc(r->size * sizeof(Viewer *));
+		if (r->viewers != NULL) {
+			memcpy(grown, r->viewers, r->count * sizeof(Viewer *));
+			Free(r->viewers);
+		}
+		r->viewers = grown;
+	}
+	v->index = r->count;
+	r->viewers[r->count++] = v;
+	if (++viewersNow > peakViewers)
+		peakViewers = viewersNow;
+	if (r->key != NULL)
+		deliver(v, r->key, NULL);
+}
+
+static void publish(int room, Frame *key, Frame *delta)
+{
+	RoomViewers *r = &roomViewerLists[room];
+	// closing swaps the last viewer in, so go from the end
+	for (int i = r->count - 1; i >= 0; i--) {
+		if (i < r->count)
+			deliver(r->viewers[i], key, delta);
+	}
+	unref(r->key);
+	r->key = key;
+	unref(delta);
+}
+
+// Viewers have nothing to say, but reading tells when they leave
+static void readViewer(Viewer *v)
+{
+	char buf[512];
+	ssize_t n;
+	while ((n = read(v->fd, buf, sizeof(buf))) > 0)
+		;
+	if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		closeViewer(v);
+}
+
+static void takeInbox(void)
+{
+	uint64_t count;
+	read(wakefd, &count, sizeof(count));
+	Message *m = __atomic_exchange_n(&inbox, NULL, __ATOMIC_ACQUIRE);
+	// the stack is newest first, a room's frames must go out in order
+	Message *ordered = NULL;
+	while (m != NULL) {
+		Message *next = m->next;
+		m->next = ordered;
+		ordered = m;
+		m = next;
+	}
+	while (ordered != NULL) {
+		Message *next = ordered->next;
+		if (ordered->fd >= 0)
+			addViewer(ordered->fd, ordered->room);
+		else
+			publish(ordered->room, ordered->key, ordered->delta);
+		Free(ordered);
+		ordered = next;
+	}
+}
+
+static void *fanout(void *vargp)
+{
+	struct epoll_event events[64];
+	while (!stopping) {
+		int n = epoll_wait(epfd, events, 64, -1);
+		for (int i = 0; i < n; i++) {
+			Viewer *v = events[i].data.ptr;
+			if (v == NULL)
+				takeInbox();
+			else if (v->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				readViewer(v);
+			if (v != NULL && v->fd >= 0 && (events[i].events & EPOLLOUT))
+				flushViewer(v);
+		}
+		while (closedViewers != NULL) {
+			Viewer *next = closedViewers->nextClosed;
+			Free(closedViewers);
+			closedViewers = next;
+		}
+	}
+	return NULL;
+}
+
+void initFanout(int rooms)
+{
+	roomViewerLists = Malloc(rooms * sizeof(RoomViewers));
+	memset(roomViewerLists, 0, rooms * sizeof(RoomViewers));
+	viewerCounts = Malloc(rooms * sizeof(int));
+	memset(viewerCounts, 0, rooms * sizeof(int));
+	waitingRooms = Malloc(rooms * sizeof(int));
+	memset(waitingRooms, 0, rooms * sizeof(int));
+	if ((epfd = epoll_create1(0)) < 0 || (wakefd = eventfd(0, 0)) < 0)
+		unix_error("initFanout error");
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+	Pthread_create(&tid, NULL, fanout, NULL);
+}
+
+void watchRoom(int fd, int room)
+{
+	Message *m = Malloc(sizeof(Message));
+	m->fd = fd;
+	m->room = room;
+	// the room publishes while it has viewers, so only the first one finds
+	// the newest keyframe out of date
+	if (__atomic_fetch_add(&viewerCounts[room], 1, __ATOMIC_RELAXED) == 0)
+		__atomic_store_n(&waitingRooms[room], 1, __ATOMIC_RELEASE);
+	push(m);
+}
+
+int roomViewers(int room)
+{
+	return __atomic_load_n(&viewerCounts[room], __ATOMIC_RELAXED);
+}
+
+bool viewerWaiting(int room)
+{
+	return __atomic_load_n(&waitingRooms[room], __ATOMIC_RELAXED) &&
+	       __atomic_exchange_n(&waitingRooms[room], 0, __ATOMIC_ACQUIRE);
+}
+
+void publishFrames(int room, unsigned tick, const void *key, size_t keyLen, const void *delta, size_t deltaLen)
+{
+	Message *m = Malloc(sizeof(Message));
+	m->fd = -1;
+	m->room = room;
+	m->key = newFrame(tick, key, keyLen);
+	m->delta = delta != NULL ? newFrame(tick, delta, deltaLen) : NULL;
+	push(m);
+}
+
+void stopFanout(void)
+{
+	stopping = 1;
+	uint64_t one = 1;
+	write(wakefd, &one, sizeof(one));
+	pthread_join(tid, NULL);
+}
+
+void printFanoutStats(FILE *out)
+{
+	if (peakViewers == 0)
+		return;
+	fprintf(out, "fanout: %lu viewers at most, %lu frames sent (%lu keyframes), %lu dropped for slow viewers\n",
+		peakViewers, framesQueued, keyframes, framesDropped);
+}
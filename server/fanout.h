@@ -0,0 +1,34 @@
+// Spectators: connections that watch a room without taking a player slot.
+// A room hands each tick's frames over once; a thread of its own writes them
+// to every viewer out of shared, reference counted buffers and drops frames
+// for viewers that fall behind, so viewers never slow down a room's tick.
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include "csapp.h"
+
+#define FANOUT_QUEUE 8	// frames held for a viewer the kernel won't take more from
+
+// Start the fanout thread for rooms rooms
+void initFanout(int rooms);
+
+// Hand a connection over to watch room, from any thread. The fanout owns fd
+// from then on.
+void watchRoom(int fd, int room);
+
+// Viewers of room right now; rooms publish nothing without any
+int roomViewers(int room);
+
+// True once after a room without viewers gets one, so a quiet room
+// publishes its state
+bool viewerWaiting(int room);
+
+// The frames of room's snapshot tick, each the ack and snapshot a player
+// would get: key for viewers that need a keyframe, delta (NULL for none) for
+// those that have tick - 1. Both are copied.
+void publishFrames(int room, unsigned tick, const void *key, size_t keyLen, const void *delta, size_t deltaLen);
+
+void stopFanout(void);
+void printFanoutStats(FILE *out);
+
+#endif /* __FANOUT_H__ */
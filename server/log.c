@@ -0,0 +1,168 @@
+#include "log.h"
+
+#define LOG_INTERVAL 10000	// us between flushes
+#define LOG_BATCH 4096		// records merged and sorted per flush
+
+// Single producer (the owning thread), single consumer (the flusher)
+typedef struct LogRing {
+	LogRecord records[LOG_RING];
+	unsigned head;		// next record to flush, written by the flusher
+	unsigned tail;		// next free record, written by the owner
+	unsigned long dropped;	// ring was full, written by the owner
+	unsigned long reported;	// drops already reported, flusher only
+	struct LogRing *next;
+} LogRing;
+
+LOGLEVEL logLevel = LOG_INFO;
+
+static LogRing *rings;		// every thread's ring, pushed lock-free
+static __thread LogRing *ring;
+static __thread struct {
+	uint64_t window;	// second the count is for
+	unsigned count;
+	unsigned suppressed;
+} limits[LOG_EVENTS];
+static sem_t flushMutex;	// serializes flushes, never taken by producers
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static LogRing *threadRing(void)
+{
+	if (ring == NULL) {
+		ring = Malloc(sizeof(LogRing));
+		memset(ring, 0, sizeof(LogRing));
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	return ring;
+}
+
+void logEvent(LOGLEVEL level, LOGEVENT event, int a, int b, int c, const char *text)
+{
+	if (level < logLevel)
+		return;
+
+	uint64_t t = now();
+	if (limits[event].window != t / 1000000000) {
+		limits[event].window = t / 1000000000;
+		limits[event].count = 0;
+	}
+	if (++limits[event].count > LOG_BURST) {
+		limits[event].suppressed++;
+		return;
+	}
+
+	LogRing *r = threadRing();
+	if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING) {
+		r->dropped++;
+		return;
+	}
+	LogRecord *rec = &r->records[r->tail % LOG_RING];
+	rec->time = t;
+	rec->level = level;
+	rec->event = event;
+	rec->suppressed = limits[event].suppressed > 0xffff ? 0xffff : limits[event].suppressed;
+	limits[event].suppressed = 0;
+	rec->a = a;
+	rec->b = b;
+	rec->c = c;
+	rec->text[0] = '\0';
+	if (text != NULL) {
+		strncpy(rec->text, text, LOG_TEXT - 1);
+		rec->text[LOG_TEXT - 1] = '\0';
+	}
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void writeRecord(const LogRecord *rec)
+{
+	FILE *out = rec->level >= LOG_WARN ? stderr : stdout;
+	switch (rec->event) {
+	case EV_ACCEPTED:
+		fprintf(out, "Accepted connection from (%s, %d)", rec->text, rec->a);
+		break;
+	case EV_REFUSED:
+		fprintf(out, "Refused connection from port %d, %s", rec->a, rec->text[0] != '\0' ? rec->text : "every room is full");
+		break;
+	case EV_CLOSED:
+		fprintf(out, "Closing connection");
+		break;
+	case EV_INVALID_MOVE:
+		fprintf(out, "Invalid move attempted from (%d, %d) in direction %d", rec->a, rec->b, rec->c);
+		break;
+	case EV_PEER_NAME:
+		fprintf(out, "%s", rec->text);
+		break;
+	case EV_JOINED:
+		fprintf(out, "Port %d is player %d in room %d (%s)", rec->a, rec->c, rec->b, rec->text);
+		break;
+	case EV_WATCHING:
+		fprintf(out, "Port %d is watching room %d", rec->a, rec->b);
+		break;
+	case EV_UPSTREAM:
+		fprintf(out, "Upstream of room %d %s", rec->a, rec->text);
+		break;
+	}
+	if (rec->suppressed > 0)
+		fprintf(out, " (%u similar suppressed)", rec->suppressed);
+	fputc('\n', out);
+}
+
+static int byTime(const void *x, const void *y)
+{
+	const LogRecord *a = x, *b = y;
+	return (a->time > b->time) - (a->time < b->time);
+}
+
+void flushLog(void)
+{
+	static LogRecord batch[LOG_BATCH];
+
+	P(&flushMutex);
+	int n = 0;
+	for (LogRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		unsigned head = r->head;
+		for (; head != tail && n < LOG_BATCH; head++)
+			batch[n++] = r->records[head % LOG_RING];
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+		unsigned long dropped = r->dropped;
+		if (dropped != r->reported) {
+			fprintf(stderr, "log: %lu records dropped\n", dropped - r->reported);
+			r->reported = dropped;
+		}
+	}
+	// put the threads' records back in order
+	qsort(batch, n, sizeof(LogRecord), byTime);
+	for (int i = 0; i < n; i++)
+		writeRecord(&batch[i]);
+	fflush(stdout);
+	fflush(stderr);
+	V(&flushMutex);
+}
+
+static void *flusher(void *vargp)
+{
+	Pthread_detach(pthread_self());
+	while (1) {
+		usleep(LOG_INTERVAL);
+		flushLog();
+	}
+	return NULL;
+}
+
+void initLog(LOGLEVEL level)
+{
+	pthread_t tid;
+	logLevel = level;
+	Sem_init(&flushMutex, 0, 1);
+	Pthread_create(&tid, NULL, flusher, NULL);
+}
@@ -0,0 +1,58 @@
+// Logging that never blocks the caller. Each thread appends fixed-size binary
+// records to its own lock-free ring; a background thread formats and writes
+// them. Records are dropped, and counted, when a ring is full, and each thread
+// passes on at most LOG_BURST records of one event per second.
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+
+typedef enum
+{
+	LOG_DEBUG,
+	LOG_INFO,	// written to stdout
+	LOG_WARN,	// and up, to stderr
+	LOG_ERROR
+} LOGLEVEL;
+
+typedef enum
+{
+	EV_ACCEPTED,	// text: host, a: port
+	EV_REFUSED,	// a: port, text: why, NULL for every room being full
+	EV_CLOSED,	// a: room, b: player
+	EV_INVALID_MOVE,	// a, b: position, c: direction
+	EV_PEER_NAME,	// text: "host is name"
+	EV_JOINED,	// a: port, b: room, c: player, text: "new" or "resumed"
+	EV_WATCHING,	// a: port, b: room
+	EV_UPSTREAM,	// a: room, text: what became of the relay's connection
+	LOG_EVENTS
+} LOGEVENT;
+
+#define LOG_TEXT 64
+#define LOG_RING 1024	// records per thread
+#define LOG_BURST 20
+
+typedef struct
+{
+	uint64_t time;	// CLOCK_MONOTONIC ns, to merge the threads' records
+	unsigned char level;
+	unsigned char event;
+	unsigned short suppressed;	// records of this event dropped by the rate limit before this one
+	int a, b, c;
+	char text[LOG_TEXT];
+} LogRecord;
+
+extern LOGLEVEL logLevel;
+
+// Start the flusher; records below level are discarded at the call site
+void initLog(LOGLEVEL level);
+
+// text may be NULL
+void logEvent(LOGLEVEL level, LOGEVENT event, int a, int b, int c, const char *text);
+
+// Write out everything logged so far, from the calling thread
+void flushLog(void);
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,666 @@
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "loop.h"
+
+#define LOOP_READSIZE 2048	// epoll: bytes read per readiness event
+#define LOOP_OUTBUF 65536	// bytes a connection may have waiting to be sent; a
+				// client further behind is hung up on
+#define LOOP_ENTRIES 256	// io_uring: submission queue size
+#define LOOP_BUFS 64		// io_uring: receive buffers in the provided ring
+#define LOOP_BUFSIZE 2048
+
+// io_uring user_data: what the request was for, and on which fd
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE, OP_TIMER, OP_CANCEL, OP_POLL };
+#define USERDATA(op, fd) (((__u64) (op) << 32) | (unsigned) (fd))
+
+typedef struct {
+	bool open;
+	bool watched;	// loopWatch: only readiness is reported
+	bool closing;	// hung up, waiting for the backend to let go of the fd
+	bool releasing;	// loopRelease, the same wait but the fd stays open
+	bool recvArmed;	// io_uring: the multishot recv is still outstanding
+	bool sending;	// io_uring: a send is in flight
+	char *out;	// out[0, outLen) waits to be sent, allocated on the first wait;
+	size_t outLen;	// with io_uring out[0, outSent) is with the kernel, with epoll
+	size_t outSent;	// EPOLLOUT is on while outLen > 0
+} Conn;
+
+struct Loop {
+	BACKEND backend;
+	int listenfd;
+	LoopHandlers h;
+	void *ctx;
+	int wakefd;	// eventfd written by loopWake
+	uint64_t wakeCount;
+	int timer;	// ms between forced ticks, -1 for none
+	struct __kernel_timespec timeout;
+	volatile sig_atomic_t stop;
+	LoopStats stats;
+	Conn conns[LOOP_MAXFD];
+
+	int epfd;
+
+	int ringfd;
+	unsigned sqEntries, sqTail, toSubmit;
+	unsigned *sqHeadp, *sqTailp, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHeadp, *cqTailp, *cqMask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *bufRing;
+	unsigned short bufTail;
+	char *bufs;
+};
+
+static void closeConn(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	l->h.closed(l->ctx, fd);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	close(fd);
+	l->stats.syscalls++;
+}
+
+static void releaseConn(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	l->h.released(l->ctx, fd);
+}
+
+static void armRecv(Loop *l, int fd);
+static void armCancel(Loop *l, int fd);
+
+void loopAdopt(Loop *l, int fd)
+{
+	l->conns[fd].open = true;
+	// a client that stops reading mustn't block the loop
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	l->stats.syscalls += 2;
+	if (l->backend == BACKEND_URING) {
+		armRecv(l, fd);
+		return;
+	}
+	struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+	epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+	l->stats.syscalls++;
+}
+
+static void armPoll(Loop *l, int fd);
+
+void loopWatch(Loop *l, int fd)
+{
+	l->conns[fd].watched = true;
+	if (l->backend == BACKEND_URING) {
+		armPoll(l, fd);
+		return;
+	}
+	struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+	epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+	l->stats.syscalls++;
+}
+
+static void openConn(Loop *l, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+
+	if (fd >= LOOP_MAXFD) {
+		close(fd);
+		return;
+	}
+	getpeername(fd, (SA *) &addr, &addrlen);
+	l->stats.syscalls++;
+	switch (l->h.accepted(l->ctx, fd, &addr, addrlen)) {
+	case ACCEPT_REFUSED:
+		close(fd);
+		break;
+	case ACCEPT_KEPT:
+		loopAdopt(l, fd);
+		break;
+	case ACCEPT_HANDED_OFF:
+		break;
+	}
+}
+
+void loopClose(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	if (!c->open || c->closing)
+		return;
+	// both backends then see the connection end like any other hang-up
+	c->closing = true;
+	shutdown(fd, SHUT_RDWR);
+	l->stats.syscalls++;
+}
+
+void loopRelease(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	if (!c->open || c->closing || c->releasing)
+		return;
+	if (l->backend == BACKEND_EPOLL) {
+		epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL);
+		l->stats.syscalls++;
+		releaseConn(l, fd);
+		return;
+	}
+	// the multishot recv ends with -ECANCELED and the fd is released then
+	c->releasing = true;
+	armCancel(l, fd);
+}
+
+static void tickDone(Loop *l, struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long us = (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+	int bucket = 0;
+	while (bucket < LOOP_LATENCY_BUCKETS - 1 && (1L << bucket) <= us)
+		bucket++;
+	l->stats.latency[bucket]++;
+	l->stats.ticks++;
+}
+
+/* epoll backend */
+
+static bool epollInit(Loop *l)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.fd = l->listenfd};
+	struct epoll_event wake = {.events = EPOLLIN, .data.fd = l->wakefd};
+	if ((l->epfd = epoll_create1(0)) < 0)
+		return false;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listenfd, &ev) < 0 ||
+	    epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &wake) < 0) {
+		close(l->epfd);
+		return false;
+	}
+	// a client that gave up before accept mustn't block the loop
+	fcntl(l->listenfd, F_SETFL, fcntl(l->listenfd, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+static void epollAccept(Loop *l)
+{
+	int fd = accept(l->listenfd, NULL, NULL);
+	l->stats.syscalls++;
+	if (fd >= 0)
+		openConn(l, fd);
+}
+
+static void epollWatchOut(Loop *l, int fd, bool on)
+{
+	struct epoll_event ev = {.events = EPOLLIN | (on ? EPOLLOUT : 0), .data.fd = fd};
+	epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev);
+	l->stats.syscalls++;
+}
+
+// The socket takes more again: send what waited for it
+static void epollWritable(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	if (c->outLen == 0)
+		return;
+	ssize_t n = write(fd, c->out, c->outLen);
+	l->stats.syscalls++;
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			loopClose(l, fd);
+		return;
+	}
+	memmove(c->out, c->out + n, c->outLen - n);
+	c->outLen -= n;
+	if (c->outLen == 0)
+		epollWatchOut(l, fd, false);
+}
+
+static void epollRun(Loop *l)
+{
+	struct epoll_event events[64];
+	char buf[LOOP_READSIZE];
+
+	while (!l->stop) {
+		int n = epoll_wait(l->epfd, events, 64, l->timer);
+		l->stats.syscalls++;
+		if (n < 0)
+			continue;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		l->stats.events += n;
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == l->listenfd) {
+				epollAccept(l);
+				continue;
+			}
+			if (fd == l->wakefd) {
+				read(fd, &l->wakeCount, sizeof(l->wakeCount));
+				l->stats.syscalls++;
+				l->h.woken(l->ctx);
+				continue;
+			}
+			if (l->conns[fd].watched) {
+				l->h.readable(l->ctx, fd);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+				epollWritable(l, fd);
+			if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				continue;
+			ssize_t r = read(fd, buf, sizeof(buf));
+			l->stats.syscalls++;
+			if (r > 0) {
+				if (!l->conns[fd].closing)
+					l->h.received(l->ctx, fd, buf, r);
+			}
+			else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+				closeConn(l, fd); // closing also drops it from the epoll set
+		}
+		l->h.tick(l->ctx);
+		tickDone(l, &start);
+	}
+}
+
+/* io_uring backend, on raw syscalls */
+
+static struct io_uring_sqe *getSqe(Loop *l)
+{
+	if (l->sqTail - __atomic_load_n(l->sqHeadp, __ATOMIC_ACQUIRE) >= l->sqEntries) {
+		// full, submit what we have without waiting for anything
+		__atomic_store_n(l->sqTailp, l->sqTail, __ATOMIC_RELEASE);
+		int r = syscall(__NR_io_uring_enter, l->ringfd, l->toSubmit, 0, 0, NULL, 0);
+		l->stats.syscalls++;
+		if (r > 0)
+			l->toSubmit -= r;
+	}
+	unsigned idx = l->sqTail & *l->sqMask;
+	struct io_uring_sqe *sqe = &l->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	l->sqArray[idx] = idx;
+	l->sqTail++;
+	l->toSubmit++;
+	return sqe;
+}
+
+static void provideBuffer(Loop *l, unsigned short bid)
+{
+	struct io_uring_buf *b = &l->bufRing->bufs[l->bufTail & (LOOP_BUFS - 1)];
+	b->addr = (unsigned long) (l->bufs + bid * LOOP_BUFSIZE);
+	b->len = LOOP_BUFSIZE;
+	b->bid = bid;
+	l->bufTail++;
+	__atomic_store_n(&l->bufRing->tail, l->bufTail, __ATOMIC_RELEASE);
+}
+
+static void armAccept(Loop *l)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = USERDATA(OP_ACCEPT, l->listenfd);
+}
+
+static void armRecv(Loop *l, int fd)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = USERDATA(OP_RECV, fd);
+	l->conns[fd].recvArmed = true;
+}
+
+static void armCancel(Loop *l, int fd)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = USERDATA(OP_RECV, fd);
+	sqe->user_data = USERDATA(OP_CANCEL, fd);
+}
+
+static void armPoll(Loop *l, int fd)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = USERDATA(OP_POLL, fd);
+}
+
+static void armWake(Loop *l)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = l->wakefd;
+	sqe->addr = (unsigned long) &l->wakeCount;
+	sqe->len = sizeof(l->wakeCount);
+	sqe->user_data = USERDATA(OP_WAKE, l->wakefd);
+}
+
+static void armTimer(Loop *l)
+{
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long) &l->timeout;
+	sqe->len = 1;
+	sqe->user_data = USERDATA(OP_TIMER, 0);
+}
+
+static void startSend(Loop *l, int fd)
+{
+	Conn *c = &l->conns[fd];
+	struct io_uring_sqe *sqe = getSqe(l);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (c->out + c->outSent);
+	sqe->len = c->outLen - c->outSent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = USERDATA(OP_SEND, fd);
+	c->sending = true;
+	c->outSent = c->outLen;
+}
+
+static bool uringInit(Loop *l)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	if ((l->ringfd = syscall(__NR_io_uring_setup, LOOP_ENTRIES, &p)) < 0)
+		return false;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		goto fail;
+
+	size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	char *ring = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, l->ringfd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto fail;
+	l->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, l->ringfd, IORING_OFF_SQES);
+	if (l->sqes == MAP_FAILED)
+		goto fail;
+	l->sqEntries = p.sq_entries;
+	l->sqHeadp = (unsigned *) (ring + p.sq_off.head);
+	l->sqTailp = (unsigned *) (ring + p.sq_off.tail);
+	l->sqMask = (unsigned *) (ring + p.sq_off.ring_mask);
+	l->sqArray = (unsigned *) (ring + p.sq_off.array);
+	l->sqTail = *l->sqTailp;
+	l->cqHeadp = (unsigned *) (ring + p.cq_off.head);
+	l->cqTailp = (unsigned *) (ring + p.cq_off.tail);
+	l->cqMask = (unsigned *) (ring + p.cq_off.ring_mask);
+	l->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+	// received data lands in buffers the kernel picks from this ring
+	l->bufRing = mmap(NULL, LOOP_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (l->bufRing == MAP_FAILED)
+		goto fail;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) l->bufRing;
+	reg.ring_entries = LOOP_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, l->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	l->bufs = Malloc(LOOP_BUFS * LOOP_BUFSIZE);
+	for (int i = 0; i < LOOP_BUFS; i++)
+		provideBuffer(l, i);
+	return true;
+
+fail:
+	close(l->ringfd);
+	return false;
+}
+
+static void uringComplete(Loop *l, struct io_uring_cqe *cqe)
+{
+	int op = cqe->user_data >> 32;
+	int fd = cqe->user_data & 0xffffffff;
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	Conn *c = &l->conns[fd];
+
+	switch (op) {
+	case OP_ACCEPT:
+		if (cqe->res >= 0)
+			openConn(l, cqe->res);
+		if (!more)
+			armAccept(l);
+		break;
+
+	case OP_RECV:
+		if (cqe->res > 0) {
+			unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!c->closing)
+				l->h.received(l->ctx, fd, l->bufs + bid * LOOP_BUFSIZE, cqe->res);
+			provideBuffer(l, bid);
+		}
+		if (more)
+			break;
+		if (c->releasing) {
+			c->recvArmed = false;
+			if (!c->sending)
+				releaseConn(l, fd);
+			break;
+		}
+		// out of buffers or stopped early: keep listening
+		if (!c->closing && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+			armRecv(l, fd);
+			break;
+		}
+		c->recvArmed = false;
+		c->closing = true;
+		if (!c->sending)
+			closeConn(l, fd);
+		break;
+
+	case OP_SEND:
+		c->sending = false;
+		if (cqe->res < 0 || c->closing) {
+			loopClose(l, fd);
+			c->outLen = c->outSent = 0;
+		}
+		else if (c->outLen > c->outSent || (size_t) cqe->res < c->outSent) {
+			// a short send, or more was queued meanwhile: send the rest
+			size_t done = cqe->res;
+			memmove(c->out, c->out + done, c->outLen - done);
+			c->outLen -= done;
+			c->outSent = 0;
+			startSend(l, fd);
+		}
+		else
+			c->outLen = c->outSent = 0;
+		if (c->releasing && !c->recvArmed && !c->sending)
+			releaseConn(l, fd);
+		else if (c->closing && !c->recvArmed && !c->sending)
+			closeConn(l, fd);
+		break;
+
+	case OP_WAKE:
+		l->h.woken(l->ctx);
+		armWake(l);
+		break;
+
+	case OP_TIMER:
+		armTimer(l);
+		break;
+
+	case OP_CANCEL:
+		// the recv it cancelled reports the outcome
+		break;
+
+	case OP_POLL:
+		if (cqe->res > 0)
+			l->h.readable(l->ctx, fd);
+		if (!more)
+			armPoll(l, fd);
+		break;
+	}
+}
+
+static void uringRun(Loop *l)
+{
+	armAccept(l);
+	armWake(l);
+	if (l->timer >= 0)
+		armTimer(l);
+	while (!l->stop) {
+		// submit everything queued during the last tick and wait for more
+		__atomic_store_n(l->sqTailp, l->sqTail, __ATOMIC_RELEASE);
+		int r = syscall(__NR_io_uring_enter, l->ringfd, l->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		l->stats.syscalls++;
+		if (r < 0)
+			continue;
+		l->toSubmit -= r;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		unsigned head = *l->cqHeadp;
+		unsigned tail = __atomic_load_n(l->cqTailp, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			uringComplete(l, &l->cqes[head & *l->cqMask]);
+			l->stats.events++;
+		}
+		__atomic_store_n(l->cqHeadp, head, __ATOMIC_RELEASE);
+		l->h.tick(l->ctx);
+		tickDone(l, &start);
+	}
+}
+
+/* common */
+
+Loop *loopCreate(BACKEND backend, int listenfd, const LoopHandlers *handlers, void *ctx)
+{
+	Loop *l = Malloc(sizeof(Loop));
+	memset(l, 0, sizeof(Loop));
+	l->backend = backend;
+	l->listenfd = listenfd;
+	l->h = *handlers;
+	l->ctx = ctx;
+	l->timer = -1;
+	if ((l->wakefd = eventfd(0, 0)) < 0) {
+		Free(l);
+		return NULL;
+	}
+	if (!(backend == BACKEND_URING ? uringInit(l) : epollInit(l))) {
+		close(l->wakefd);
+		Free(l);
+		return NULL;
+	}
+	return l;
+}
+
+// Copy what q holds to the end of the connection's out. False, hanging up,
+// if the client isn't keeping up with the updates.
+static bool holdOut(Loop *l, FrameQueue *q)
+{
+	Conn *c = &l->conns[q->fd];
+	if (c->out == NULL)
+		c->out = Malloc(LOOP_OUTBUF);
+	ssize_t n = gatherFrames(q, c->out + c->outLen, LOOP_OUTBUF - c->outLen);
+	if (n < 0) {
+		clearFrames(q);
+		loopClose(l, q->fd);
+		return false;
+	}
+	c->outLen += n;
+	return true;
+}
+
+void loopSend(Loop *l, FrameQueue *q)
+{
+	Conn *c = &l->conns[q->fd];
+	if (c->closing) {
+		clearFrames(q);
+		return;
+	}
+
+	if (l->backend == BACKEND_EPOLL) {
+		// once something waits for EPOLLOUT, the rest queues up behind it
+		if (c->outLen == 0) {
+			unsigned long before = q->syscalls;
+			ssize_t n = flushFrames(q);
+			l->stats.syscalls += q->syscalls - before;
+			if (n < 0) {
+				loopClose(l, q->fd);
+				return;
+			}
+			if (q->pending == 0)
+				return;
+		}
+		bool waiting = c->outLen > 0;
+		if (holdOut(l, q) && !waiting)
+			epollWatchOut(l, q->fd, true);
+		return;
+	}
+
+	if (holdOut(l, q) && !c->sending && c->outLen > 0)
+		startSend(l, q->fd);
+}
+
+void loopRun(Loop *l)
+{
+	if (l->backend == BACKEND_URING)
+		uringRun(l);
+	else
+		epollRun(l);
+}
+
+void loopSetTimer(Loop *l, int ms)
+{
+	l->timer = ms;
+	l->timeout.tv_sec = ms / 1000;
+	l->timeout.tv_nsec = (ms % 1000) * 1000000L;
+}
+
+void loopWake(Loop *l)
+{
+	uint64_t one = 1;
+	write(l->wakefd, &one, sizeof(one));
+}
+
+void loopStop(Loop *l)
+{
+	l->stop = 1;
+	loopWake(l);
+}
+
+const LoopStats *loopStats(const Loop *l)
+{
+	return &l->stats;
+}
+
+// Upper bound in us of the tick time below which a fraction p of the ticks fall
+static long percentile(const LoopStats *s, double p)
+{
+	unsigned long seen = 0;
+	for (int i = 0; i < LOOP_LATENCY_BUCKETS; i++) {
+		seen += s->latency[i];
+		if (seen >= p * s->ticks)
+			return 1L << i;
+	}
+	return 1L << (LOOP_LATENCY_BUCKETS - 1);
+}
+
+void printLoopStats(const Loop *l, FILE *out)
+{
+	const LoopStats *s = &l->stats;
+	if (s->ticks == 0)
+		return;
+	fprintf(out, "%s: %lu ticks, %lu events, %lu syscalls (%.2f/tick, %.2f/event)\n",
+		l->backend == BACKEND_URING ? "io_uring" : "epoll", s->ticks, s->events, s->syscalls,
+		(double) s->syscalls / s->ticks, s->events ? (double) s->syscalls / s->events : 0.0);
+	fprintf(out, "tick time: p50 < %ld us, p99 < %ld us, p99.9 < %ld us\n",
+		percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999));
+}
@@ -0,0 +1,92 @@
+// Single-threaded event loop for the server's sockets. The game code only
+// sees the callbacks below; how sockets are watched, read and written is up
+// to the backend chosen at startup.
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include "csapp.h"
+#include "frame.h"
+
+typedef enum
+{
+	BACKEND_EPOLL,	// readiness with epoll_wait, read and writev per socket
+	BACKEND_URING	// completions from io_uring: multishot accept and recv into
+			// a provided buffer ring, sends queued and submitted once per tick
+} BACKEND;
+
+#define LOOP_MAXFD 65536	// connections above are refused
+
+typedef enum
+{
+	ACCEPT_REFUSED,	// the loop closes the connection
+	ACCEPT_KEPT,	// the loop watches it from now on
+	ACCEPT_HANDED_OFF	// given to another loop, forget about it
+} ACCEPTRESULT;
+
+// Every handler gets the ctx passed to loopCreate
+typedef struct
+{
+	// a new connection
+	ACCEPTRESULT (*accepted)(void *ctx, int fd, struct sockaddr_storage *addr, socklen_t addrlen);
+	// bytes read from fd; they are only valid during the call
+	void (*received)(void *ctx, int fd, const char *buf, size_t len);
+	// fd hung up or was closed with loopClose, it is closed after the call
+	void (*closed)(void *ctx, int fd);
+	// loopWake was called, possibly several times, since the last call
+	void (*woken)(void *ctx);
+	// once per tick, after every event of the tick was handled
+	void (*tick)(void *ctx);
+	// the loop is done with fd after loopRelease, it is still open
+	void (*released)(void *ctx, int fd);
+	// a loopWatch fd can be read from; read it until EAGAIN
+	void (*readable)(void *ctx, int fd);
+} LoopHandlers;
+
+// Tick service time histogram: bucket i counts ticks that took < 2^i us
+#define LOOP_LATENCY_BUCKETS 24
+
+typedef struct
+{
+	unsigned long ticks;
+	unsigned long events;
+	unsigned long syscalls;
+	unsigned long latency[LOOP_LATENCY_BUCKETS];
+} LoopStats;
+
+typedef struct Loop Loop;
+
+// Returns NULL if the backend is not available on this kernel
+Loop *loopCreate(BACKEND backend, int listenfd, const LoopHandlers *handlers, void *ctx);
+
+// Run a tick at least every ms milliseconds, even with nothing happening.
+// Call before loopRun.
+void loopSetTimer(Loop *loop, int ms);
+
+// Start watching a connection accepted by another loop
+void loopAdopt(Loop *loop, int fd);
+
+// Call handlers->readable whenever a non-blocking fd the loop doesn't read
+// itself, such as a datagram socket, has something to read
+void loopWatch(Loop *loop, int fd);
+
+// Send everything queued on q (q->fd is the destination)
+void loopSend(Loop *loop, FrameQueue *q);
+
+// Hang up on fd; handlers->closed follows once the backend is done with it
+void loopClose(Loop *loop, int fd);
+
+// Stop watching fd without closing it, to hand it to another loop. More
+// received calls may come before handlers->released.
+void loopRelease(Loop *loop, int fd);
+
+// Run until loopStop is called
+void loopRun(Loop *loop);
+
+// Both may be called from any thread or from a signal handler
+void loopWake(Loop *loop);
+void loopStop(Loop *loop);
+
+const LoopStats *loopStats(const Loop *loop);
+void printLoopStats(const Loop *loop, FILE *out);
+
+#endif /* __LOOP_H__ */
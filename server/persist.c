@@ -0,0 +1,114 @@
+#include "persist.h"
+#include "replay.h"
+
+static const char *imageDir;
+static RoomImage *images;	// one slot per room, filled by its shard
+static int *pending;		// slot is waiting for the saver, set atomically
+static int roomCount;
+static sem_t items;
+
+static void imagePath(char *path, const char *dir, int room, const char *suffix)
+{
+	snprintf(path, MAXLINE, "%s/room%d.state%s", dir, room, suffix);
+}
+
+static void fillImage(RoomImage *image, int room, const GameState *game, unsigned tick)
+{
+	image->magic = IMAGE_MAGIC;
+	image->version = IMAGE_VERSION;
+	image->room = room;
+	image->checksum = replayChecksum(game);
+	image->saved = time(NULL);
+	image->tick = tick;
+	image->reserved = 0;
+	image->game = *game;
+}
+
+// Write to a temporary file and rename it over the old image, so a crash
+// leaves either the old image or the new one
+static bool writeImage(const RoomImage *image)
+{
+	char tmp[MAXLINE], path[MAXLINE];
+	imagePath(tmp, imageDir, image->room, ".tmp");
+	imagePath(path, imageDir, image->room, "");
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	bool ok = write(fd, image, sizeof(*image)) == sizeof(*image) && fsync(fd) == 0;
+	close(fd);
+	return ok && rename(tmp, path) == 0;
+}
+
+static void *saver(void *vargp)
+{
+	Pthread_detach(pthread_self());
+	while (1) {
+		P(&items);
+		for (int i = 0; i < roomCount; i++) {
+			if (!__atomic_load_n(&pending[i], __ATOMIC_ACQUIRE))
+				continue;
+			if (!writeImage(&images[i]))
+				fprintf(stderr, "cannot save room %d: %s\n", i, strerror(errno));
+			__atomic_store_n(&pending[i], 0, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+void initSaver(const char *dir, int rooms)
+{
+	pthread_t tid;
+	imageDir = dir;
+	roomCount = rooms;
+	images = Malloc(rooms * sizeof(RoomImage));
+	pending = Malloc(rooms * sizeof(int));
+	memset(pending, 0, rooms * sizeof(int));
+	Sem_init(&items, 0, 0);
+	Pthread_create(&tid, NULL, saver, NULL);
+}
+
+bool saveRoom(int room, const GameState *game, unsigned tick)
+{
+	if (__atomic_load_n(&pending[room], __ATOMIC_ACQUIRE))
+		return false;
+	fillImage(&images[room], room, game, tick);
+	__atomic_store_n(&pending[room], 1, __ATOMIC_RELEASE);
+	V(&items);
+	return true;
+}
+
+bool writeRoomImage(int room, const GameState *game, unsigned tick)
+{
+	RoomImage image;
+	// the saver may be writing the same temporary file
+	while (__atomic_load_n(&pending[room], __ATOMIC_ACQUIRE))
+		usleep(1000);
+	fillImage(&image, room, game, tick);
+	return writeImage(&image);
+}
+
+bool loadRoomImage(const char *dir, int room, RoomImage *image)
+{
+	char path[MAXLINE];
+	struct stat st;
+	imagePath(path, dir, room, "");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_size != sizeof(RoomImage)) {
+		close(fd);
+		return false;
+	}
+	const RoomImage *map = mmap(NULL, sizeof(RoomImage), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	bool ok = map->magic == IMAGE_MAGIC && map->version == IMAGE_VERSION && map->room == (uint32_t) room &&
+		  map->checksum == replayChecksum(&map->game);
+	if (ok)
+		*image = *map;
+	munmap((void *) map, sizeof(RoomImage));
+	return ok;
+}
@@ -0,0 +1,40 @@
+// Room images: a binary copy of a room's game, saved in the background so a
+// restarted server can pick its games up where they were. An image is the
+// native GameState layout behind a small header, loaded with one mmap.
+#ifndef __PERSIST_H__
+#define __PERSIST_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "game.h"
+
+#define IMAGE_MAGIC 0x49524354 // "TCRI"
+#define IMAGE_VERSION 1
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t room;
+	uint32_t checksum;	// replayChecksum of game
+	uint64_t saved;		// wall clock, seconds
+	uint32_t tick;
+	uint32_t reserved;
+	GameState game;
+} RoomImage;
+
+// Start the thread saving images of up to rooms rooms to dir
+void initSaver(const char *dir, int rooms);
+
+// Copy game for the saver thread. Returns false without copying if the
+// room's previous image is still being written.
+bool saveRoom(int room, const GameState *game, unsigned tick);
+
+// Write an image now, from the calling thread
+bool writeRoomImage(int room, const GameState *game, unsigned tick);
+
+// Load the room's last image, false if there is none or it is damaged
+bool loadRoomImage(const char *dir, int room, RoomImage *image);
+
+#endif /* __PERSIST_H__ */
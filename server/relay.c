@@ -0,0 +1,178 @@
+#include "relay.h"
+#include "fanout.h"
+#include "frame.h"
+#include "log.h"
+#include "pack.h"
+
+// What a relay knows of one upstream room, only touched by its thread
+typedef struct
+{
+	int room;
+	bool hasState;	// game is the state of tick
+	unsigned tick;	// ours, which only goes forward for our viewers' sake
+	unsigned upstreamTick;	// the upstream's for the same state; a restarted
+				// upstream starts over from 0
+	GameState game;
+} RelayRoom;
+
+static char *upstreamHost, *upstreamPort;
+static bool packLz;
+
+static unsigned get32(const unsigned char *p)
+{
+	return (unsigned) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// An ack for tick and the frame after it, as viewers get them
+static ssize_t makeFrames(char *out, size_t size, unsigned tick, FRAMETYPE type, const void *payload, size_t len)
+{
+	FrameQueue q;
+	unsigned char ack[8] = {0};
+	put32(ack + 4, tick);
+	initFrameQueue(&q, -1);
+	queueFrame(&q, FRAME_ACK, ack, sizeof(ack));
+	queueFrame(&q, type, payload, len);
+	ssize_t n = gatherFrames(&q, out, size);
+	clearFrames(&q);
+	return n;
+}
+
+// Take in the upstream's snapshot of its tick upstreamTick, a keyframe or a
+// delta from the tick before, and publish it both ways. False if it doesn't
+// follow from what we have.
+static bool relayTick(RelayRoom *r, unsigned upstreamTick, FRAMETYPE type, const unsigned char *buf, size_t len)
+{
+	GameState next;
+	unsigned char key[PACK_MAXLEN], delta[4 + PACK_MAXLEN];
+	int keyLen, deltaLen = -1;
+	unsigned tick = upstreamTick;
+	if (r->hasState)
+		tick = r->tick + ((int) (upstreamTick - r->upstreamTick) > 0 ? upstreamTick - r->upstreamTick : 1);
+	if (type == FRAME_PACKED) {
+		if (len > sizeof(key) || !unpackSnapshot(buf, len, NULL, &next))
+			return false;
+		memcpy(key, buf, len);
+		keyLen = len;
+		// the upstream sent a keyframe after dropping frames for us, or to a
+		// relay that just connected; a delta still serves viewers in step
+		if (r->hasState && r->tick == tick - 1) {
+			put32(delta, r->tick);
+			deltaLen = 4 + packSnapshot(&next, &r->game, false, delta + 4);
+			if (deltaLen - 4 >= keyLen)
+				deltaLen = -1;
+		}
+	}
+	else {
+		if (len < 4 || !r->hasState || get32(buf) != r->upstreamTick || upstreamTick != r->upstreamTick + 1 ||
+		    !unpackSnapshot(buf + 4, len - 4, &r->game, &next))
+			return false;
+		keyLen = packSnapshot(&next, NULL, packLz, key);
+		put32(delta, r->tick);
+		memcpy(delta + 4, buf + 4, len - 4);
+		deltaLen = len;
+	}
+	r->game = next;
+	r->tick = tick;
+	r->upstreamTick = upstreamTick;
+	r->hasState = true;
+
+	char keyFrames[2 * FRAME_HEADER + 8 + PACK_MAXLEN];
+	char deltaFrames[2 * FRAME_HEADER + 12 + PACK_MAXLEN];
+	ssize_t keyFramesLen = makeFrames(keyFrames, sizeof(keyFrames), tick, FRAME_PACKED, key, keyLen);
+	ssize_t deltaFramesLen = -1;
+	if (deltaLen > 0)
+		deltaFramesLen = makeFrames(deltaFrames, sizeof(deltaFrames), tick, FRAME_PACKED_DELTA, delta, deltaLen);
+	publishFrames(r->room, tick, keyFrames, keyFramesLen, deltaFramesLen > 0 ? deltaFrames : NULL, deltaFramesLen);
+	return true;
+}
+
+// Watch the room on fd until the upstream goes away or says something that
+// doesn't add up
+static void follow(RelayRoom *r, int fd)
+{
+	char line[32];
+	snprintf(line, sizeof(line), "watch %d\n", r->room);
+	if (rio_writen(fd, line, strlen(line)) < 0)
+		return;
+
+	rio_t rio;
+	rio_readinitb(&rio, fd);
+	unsigned char payload[4 + PACK_MAXLEN];
+	bool acked = false;
+	unsigned tick = 0;
+	FRAMETYPE type;
+	ssize_t n;
+	while ((n = readFrame(&rio, &type, payload, sizeof(payload))) > 0) {
+		if (type == FRAME_ACK && n == 8) {
+			tick = get32(payload + 4);
+			acked = true;
+		}
+		else if (type == FRAME_PACKED || type == FRAME_PACKED_DELTA) {
+			if (!acked || !relayTick(r, tick, type, payload, n))
+				return;
+			acked = false;
+		}
+	}
+}
+
+static void *relay(void *vargp)
+{
+	RelayRoom *r = vargp;
+	Pthread_detach(pthread_self());
+	while (1) {
+		int fd = open_clientfd(upstreamHost, upstreamPort);
+		if (fd >= 0) {
+			logEvent(LOG_INFO, EV_UPSTREAM, r->room, 0, 0, "connected");
+			follow(r, fd);
+			close(fd);
+			logEvent(LOG_WARN, EV_UPSTREAM, r->room, 0, 0, "lost");
+		}
+		usleep(RELAY_RETRY * 1000);
+	}
+	return NULL;
+}
+
+int upstreamRooms(char *host, char *port)
+{
+	for (bool waiting = false;; waiting = true) {
+		if (waiting)
+			usleep(RELAY_RETRY * 1000);
+		int fd = open_clientfd(host, port);
+		if (fd < 0) {
+			if (!waiting)
+				fprintf(stderr, "waiting for %s:%s\n", host, port);
+			continue;
+		}
+		rio_t rio;
+		unsigned char count[2];
+		FRAMETYPE type;
+		rio_readinitb(&rio, fd);
+		bool ok = rio_writen(fd, "rooms\n", 6) == 6 && readFrame(&rio, &type, count, sizeof(count)) == 2 &&
+			  type == FRAME_ROOMS;
+		close(fd);
+		if (ok && (count[0] << 8 | count[1]) > 0)
+			return count[0] << 8 | count[1];
+	}
+}
+
+void initRelay(char *host, char *port, int rooms, bool lz)
+{
+	upstreamHost = host;
+	upstreamPort = port;
+	packLz = lz;
+	RelayRoom *relayRooms = Malloc(rooms * sizeof(RelayRoom));
+	memset(relayRooms, 0, rooms * sizeof(RelayRoom));
+	for (int i = 0; i < rooms; i++) {
+		pthread_t tid;
+		relayRooms[i].room = i;
+		Pthread_create(&tid, NULL, relay, &relayRooms[i]);
+	}
+}
@@ -0,0 +1,21 @@
+// Relays: a server started with -R plays no game of its own. For each of its
+// rooms it watches the same room of an upstream server (or relay) over one
+// connection and hands every tick to the fanout, so its own viewers cost the
+// upstream nothing. The stream is followed into a GameState, so each tick
+// goes out both as a keyframe, for viewers that just arrived or fell behind,
+// and as a delta from the tick before.
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+
+#define RELAY_RETRY 1000	// ms between attempts to reach the upstream
+
+// Ask host:port how many rooms it has, retrying until it answers
+int upstreamRooms(char *host, char *port);
+
+// Start following rooms rooms of host:port, a thread for each. Keyframes made
+// from deltas go through the LZ codec when lz is set.
+void initRelay(char *host, char *port, int rooms, bool lz);
+
+#endif /* __RELAY_H__ */
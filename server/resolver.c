@@ -0,0 +1,108 @@
+#include "resolver.h"
+#include "log.h"
+
+#define RESOLVER_QUEUE 64
+#define RESOLVER_CACHE 256	// entries, direct mapped by numeric host
+#define RESOLVER_TTL 300	// seconds a name (or a failed lookup) is remembered
+
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+} Request;
+
+typedef struct {
+	char host[NI_MAXHOST];	// numeric address, "" if the entry is unused
+	char name[NI_MAXHOST];	// "" if the lookup failed
+	time_t expires;
+} CacheEntry;
+
+// bounded queue of pending lookups, filled by the shards
+static Request queue[RESOLVER_QUEUE];
+static int front, rear;
+static sem_t mutex, slots, items;
+
+static CacheEntry cache[RESOLVER_CACHE];
+static sem_t cacheMutex;
+
+static CacheEntry *cacheSlot(const char *host)
+{
+	unsigned h = 2166136261u;
+	for (; *host; host++)
+		h = (h ^ (unsigned char) *host) * 16777619u;
+	return &cache[h % RESOLVER_CACHE];
+}
+
+// Copies the cached name of host into name, false if it isn't known
+static bool lookupCache(const char *host, char *name)
+{
+	bool found = false;
+	P(&cacheMutex);
+	CacheEntry *e = cacheSlot(host);
+	if (strcmp(e->host, host) == 0 && e->expires > time(NULL)) {
+		strcpy(name, e->name);
+		found = true;
+	}
+	V(&cacheMutex);
+	return found;
+}
+
+static void storeCache(const char *host, const char *name)
+{
+	P(&cacheMutex);
+	CacheEntry *e = cacheSlot(host);
+	strcpy(e->host, host);
+	strcpy(e->name, name);
+	e->expires = time(NULL) + RESOLVER_TTL;
+	V(&cacheMutex);
+}
+
+static void *resolver(void *vargp)
+{
+	Pthread_detach(pthread_self());
+	while (1) {
+		P(&items);
+		P(&mutex);
+		Request req = queue[front++ % RESOLVER_QUEUE];
+		V(&mutex);
+		V(&slots);
+
+		char host[NI_MAXHOST], name[NI_MAXHOST];
+		if (getnameinfo((SA *) &req.addr, req.addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+			continue;
+		if (!lookupCache(host, name)) {
+			if (getnameinfo((SA *) &req.addr, req.addrlen, name, sizeof(name), NULL, 0, NI_NAMEREQD) != 0)
+				name[0] = '\0';
+			storeCache(host, name);
+		}
+		if (name[0] != '\0') {
+			char text[LOG_TEXT];
+			if (snprintf(text, sizeof(text), "%s is %s", host, name) >= (int) sizeof(text))
+				strcpy(text + sizeof(text) - 4, "...");
+			logEvent(LOG_INFO, EV_PEER_NAME, 0, 0, 0, text);
+		}
+	}
+	return NULL;
+}
+
+void initResolver(int threads)
+{
+	pthread_t tid;
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&slots, 0, RESOLVER_QUEUE);
+	Sem_init(&items, 0, 0);
+	Sem_init(&cacheMutex, 0, 1);
+	for (int i = 0; i < threads; i++)
+		Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+void resolvePeer(const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	if (sem_trywait(&slots) < 0)
+		return;
+	P(&mutex);
+	Request *req = &queue[rear++ % RESOLVER_QUEUE];
+	memcpy(&req->addr, addr, addrlen);
+	req->addrlen = addrlen;
+	V(&mutex);
+	V(&items);
+}
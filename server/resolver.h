@@ -0,0 +1,17 @@
+// Background reverse DNS for peer addresses, so a slow or unreachable
+// resolver never holds up accepting connections
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "csapp.h"
+
+#define RESOLVER_THREADS 2
+
+// Start the resolver threads
+void initResolver(int threads);
+
+// Queue a lookup of addr's host name, which is printed when it is known.
+// Never blocks: the request is dropped if the queue is full.
+void resolvePeer(const struct sockaddr_storage *addr, socklen_t addrlen);
+
+#endif /* __RESOLVER_H__ */
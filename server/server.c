@@ -1,684 +1,1025 @@
-#include <stdio.h>
-#include <stdbool.h>
-#include <time.h>
-
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <ctype.h>
-#include <setjmp.h>
-#include <signal.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <errno.h>
-#include <math.h>
-#include <pthread.h>
-#include <semaphore.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-// Definitions from csapp.h
-#define	MAXLINE	 8192  /* Max text line length */
-#define LISTENQ  1024  /* Second argument to listen() */
-#define RIO_BUFSIZE 8192
-
-
-// Definitions from client.c
-// Dimensions for the drawn grid (should be GRIDSIZE * texture dimensions)
-#define GRID_DRAW_WIDTH 640
-#define GRID_DRAW_HEIGHT 640
-
-#define WINDOW_WIDTH GRID_DRAW_WIDTH
-#define WINDOW_HEIGHT (HEADER_HEIGHT + GRID_DRAW_HEIGHT)
-
-// Header displays current score
-#define HEADER_HEIGHT 50
-
-// Number of cells vertically/horizontally in the grid
-#define GRIDSIZE 10
-
-typedef struct sockaddr SA;
+#define _GNU_SOURCE // pthread_setaffinity_np
+#include <sys/random.h>
+#include <sys/resource.h>
+
+#include "csapp.h"
+#include "game.h"
+#include "frame.h"
+#include "loop.h"
+#include "resolver.h"
+#include "log.h"
+#include "replay.h"
+#include "persist.h"
+#include "impair.h"
+#include "pack.h"
+#include "fanout.h"
+#include "relay.h"
+
+// GAME CODE
+// A game of up to 4 players. Each room is owned by one shard and only
+// touched from that shard's thread, apart from reserved and resumable.
+typedef struct Shard Shard;
+
+#define HISTORY_LEN 64 // snapshots kept to send a resuming player only what changed
+#define RESUME_GRACE 10000 // ms a dropped player's slot is held for
 
 typedef struct {
-    int rio_fd;                /* Descriptor for this internal buf */
-    int rio_cnt;               /* Unread bytes in internal buf */
-    char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
-} rio_t;
+	unsigned tick;
+	int len;
+	char text[SNAPSHOT_MAXLEN + 1];
+	GameState game; // what text and packed encode, packed deltas are made from it
+	int packedLen;
+	unsigned char packed[PACK_MAXLEN];
+} Snapshot;
 
-void unix_error(char *msg) /* Unix-style error */
-{
-    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
-    exit(0);
+typedef struct {
+	GameState game;
+	int playerCount;
+	bool playerNumber[4];
+	int connections[4]; // fd of each player, -1 while dropped
+	uint64_t token[4]; // given to each player on joining, to take its slot back with
+	uint64_t resumable[4]; // token of a dropped player, claimed atomically by its reconnect
+	long droppedAt[4]; // ms, CLOCK_MONOTONIC
+	bool leaving[4]; // said quit, the slot is not held
+	bool hasBase[4]; // the player has snapshot baseTick, the next one over TCP can be a delta
+	unsigned baseTick[4];
+	Snapshot history[HISTORY_LEN]; // by tick % HISTORY_LEN
+	bool compact[4]; // snapshots go out packed (pack.h)
+	bool udp[4]; // snapshots go out as datagrams, to udpAddr
+	struct sockaddr_storage udpAddr[4];
+	socklen_t udpAddrLen[4];
+	unsigned udpAcked[4]; // newest tick the player says it has, deltas are made from it
+	bool reliable; // a join, leave or new level: UDP players get this snapshot over TCP too
+	FrameQueue queues[4]; // outgoing frames per player, flushed once per broadcast
+	unsigned lastInput[4]; // sequence number of the last command processed per player
+	bool spectating[4]; // connected but not on the grid
+	char input[4][MAXLINE]; // bytes received after the last complete line
+	size_t inputLen[4];
+	bool changed; // something to broadcast at the end of the tick
+	unsigned tick; // snapshots broadcast so far
+	bool recording;
+	ReplayWriter replay; // every accepted input, with -r
+	bool unsaved; // changed since the last image was taken, with -S
+	long lastSave; // ms, CLOCK_MONOTONIC
+	int reserved; // players plus connections on their way in, updated atomically
+	Shard *owner;
+} Room;
+
+// A connection that hasn't said yet whether it starts or resumes a game, or
+// watches one. Its first line picks the room; if another shard owns it, the
+// loop releases the fd and it is handed off with everything received so far.
+// Viewers are released to the fanout whichever room they watch.
+typedef struct {
+	int port;
+	char buf[MAXLINE];
+	size_t len;
+	Room *room; // set once the first line is in
+	int slot; // player to resume, -1 for a new one
+	unsigned lastTick; // of the last snapshot the resuming client has
+	bool watching; // a viewer of room, it never takes a slot
+} Joining;
+
+Joining *joining[LOOP_MAXFD]; // by fd, only touched by the shard holding it
+
+// A connection accepted by one shard for a room owned by another
+typedef struct Handoff {
+	int fd;
+	Joining *join;
+	struct Handoff *next;
+} Handoff;
+
+// A thread with its own listening socket (SO_REUSEPORT), event loop and room
+struct Shard {
+	int id;
+	int listenfd;
+	Loop *loop;
+	Room *room;
+	Handoff *inbox; // lock-free stack pushed by other shards
+	int udpfd; // -1 without -u
+	int udpPort;
+	int tcpPort;
+	pthread_t tid;
+};
+
+Room *rooms;
+Shard *shards;
+int shardCount;
+bool resolveNames; // look up peers' host names in the background
+char *recordDir; // where rooms write their replay logs, NULL to not record
+#define REPLAY_CHECK_INTERVAL 256 // ticks
+char *stateDir; // where room images are saved and restored from, NULL for none
+#define SAVE_INTERVAL 1000 // ms between images of a room that keeps changing
+bool useUdp; // each shard also takes datagrams on port + 1 + its id
+#define UDP_MAXDGRAM 512
+Impair impair;
+Impair *impaired; // loss and latency added to outgoing datagrams, NULL for none
+#define IMPAIR_TICK 5 // ms between sends of held datagrams
+bool packLz; // packed keyframes go through the LZ codec when that is smaller
+char *relayHost, *relayPort; // with -R, the server whose rooms we relay to viewers
+
+long msNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void gai_error(int code, char *msg) /* Getaddrinfo-style error */
-{
-    fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
-    exit(0);
+void record(Room *room, REPLAYOP op, int player, int arg, unsigned value) {
+	if (room->recording) {
+		writeReplay(&room->replay, room->tick, op, player, arg, value);
+	}
 }
 
-void app_error(char *msg) /* Application error */
-{
-    fprintf(stderr, "%s\n", msg);
-    exit(0);
+// Start room's log in recordDir. A restored room keeps its seed, so an
+// earlier run's log of it may be there already: that one gets a number.
+void startRecording(Room *room, int id) {
+	char path[MAXLINE];
+	int n = 0;
+	do {
+		if (n++ == 0) {
+			snprintf(path, sizeof(path), "%s/room%d-%u.replay", recordDir, id, room->game.seed);
+		}
+		else {
+			snprintf(path, sizeof(path), "%s/room%d-%u.%d.replay", recordDir, id, room->game.seed, n);
+		}
+		room->recording = openReplayWriter(&room->replay, path, &room->game, id);
+	} while (!room->recording && errno == EEXIST);
+	if (!room->recording) {
+		fprintf(stderr, "cannot record to %s: %s\n", path, strerror(errno));
+	}
 }
 
-void rio_readinitb(rio_t *rp, int fd) 
+void tryMove(Room *room, int player, DIRECTION dir)
 {
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+	Position from = room->game.playerPosition[player];
+	int level = room->game.level;
+	record(room, REPLAY_MOVE, player, dir, 0);
+	if (movePlayer(&room->game, player, dir) == MOVE_NOT_ADJACENT)
+		logEvent(LOG_WARN, EV_INVALID_MOVE, from.x, from.y, dir, NULL);
+	// lets a replay check it is still in step
+	if (room->game.level != level) {
+		record(room, REPLAY_LEVEL, player, room->game.level, room->game.seed);
+		room->reliable = true;
+	}
 }
 
-ssize_t rio_writen(int fd, void *usrbuf, size_t n) 
-{
-    size_t nleft = n;
-    ssize_t nwritten;
-    char *bufp = usrbuf;
+void removePlayer(Room *room, int player) {
+	despawnPlayer(&room->game, player);
+	record(room, REPLAY_LEAVE, player, 0, 0);
+	room->playerNumber[player] = false;
+	room->playerCount--;
+	room->reliable = true;
+	__atomic_fetch_sub(&room->reserved, 1, __ATOMIC_RELEASE);
+}
+
+bool initializePlayer(Room *room, int player) {
+	room->playerNumber[player] = true;
+	room->leaving[player] = false;
+	room->hasBase[player] = false;
+	room->compact[player] = false;
+	room->udp[player] = false;
+	room->lastInput[player] = 0;
+	room->inputLen[player] = 0;
+	room->spectating[player] = false;
+	bool spawned = spawnPlayer(&room->game, player);
+	record(room, REPLAY_JOIN, player, 0, 0);
+	return spawned;
+}
+
+// A player whose connection is up, not dropped and waiting to resume
+bool connected(Room *room, int player) {
+	return room->playerNumber[player] == true && room->connections[player] >= 0;
+}
+
+// Commands are text lines, "<name>[ <arg>]\n". A handler returns true when
+// the connection should be closed.
+typedef bool (*CommandHandler)(Room *room, int player, char *arg);
 
-    while (nleft > 0) {
-	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-	    if (errno == EINTR)  /* Interrupted by sig handler return */
-		nwritten = 0;    /* and call write() again */
-	    else
-		return -1;       /* errno set by write() */
+void applyMove(Room *room, int player, DIRECTION dir) {
+	if (!room->spectating[player]) {
+		tryMove(room, player, dir);
 	}
-	nleft -= nwritten;
-	bufp += nwritten;
-    }
-    return n;
+	room->changed = true;
 }
 
-void Rio_writen(int fd, void *usrbuf, size_t n) 
-{
-    if (rio_writen(fd, usrbuf, n) != n)
-	unix_error("Rio_writen error");
+// Moves resent after a resume or in every datagram until acked are only
+// applied the first time
+void sequencedMove(Room *room, int player, unsigned seq, DIRECTION dir) {
+	if ((int) (seq - room->lastInput[player]) > 0) {
+		room->lastInput[player] = seq;
+		applyMove(room, player, dir);
+	}
 }
 
-void Rio_readinitb(rio_t *rp, int fd)
-{
-    rio_readinitb(rp, fd);
-} 
+// moves may carry a sequence number ("up 17") which is sent back in acks so
+// the client knows which of its predicted moves are applied
+bool move(Room *room, int player, char *arg, DIRECTION dir) {
+	if (*arg != '\0') {
+		sequencedMove(room, player, strtoul(arg, NULL, 10), dir);
+	}
+	else {
+		applyMove(room, player, dir);
+	}
+	return false;
+}
 
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;          
-    if (rp->rio_cnt < n)   
-	cnt = rp->rio_cnt;
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
-}
-
-void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, 
-                 size_t hostlen, char *serv, size_t servlen, int flags)
-{
-    int rc;
+bool cmdUp(Room *room, int player, char *arg) { return move(room, player, arg, DIR_UP); }
+bool cmdDown(Room *room, int player, char *arg) { return move(room, player, arg, DIR_DOWN); }
+bool cmdLeft(Room *room, int player, char *arg) { return move(room, player, arg, DIR_LEFT); }
+bool cmdRight(Room *room, int player, char *arg) { return move(room, player, arg, DIR_RIGHT); }
 
-    if ((rc = getnameinfo(sa, salen, host, hostlen, serv, 
-                          servlen, flags)) != 0) 
-        gai_error(rc, "Getnameinfo error");
+bool cmdQuit(Room *room, int player, char *arg) {
+	return true;
 }
 
-void Close(int fd) 
-{
-    int rc;
+// first line of every client, answered with the current state
+bool cmdStart(Room *room, int player, char *arg) {
+	room->changed = true;
+	return false;
+}
 
-    if ((rc = close(fd)) < 0)
-	unix_error("Close error");
+// Queue a frame outside a broadcast, sending what the player has queued
+// first if there is no room left for it
+void reply(Room *room, int player, FRAMETYPE type, const void *payload, size_t len) {
+	FrameQueue *q = &room->queues[player];
+	if (queueFrame(q, type, payload, len) < 0 && q->pending > 0) {
+		loopSend(room->owner->loop, q);
+		queueFrame(q, type, payload, len);
+	}
 }
 
-int Accept(int s, struct sockaddr *addr, socklen_t *addrlen) 
-{
-    int rc;
+// echo the argument back, cut to the longest frame that fits
+bool cmdPing(Room *room, int player, char *arg) {
+	size_t len = strlen(arg) < FRAMEQ_MAXCOPY ? strlen(arg) : FRAMEQ_MAXCOPY;
+	reply(room, player, FRAME_PONG, arg, len);
+	return false;
+}
 
-    if ((rc = accept(s, addr, addrlen)) < 0)
-	unix_error("Accept error");
-    return rc;
+// pass the text on to everyone in the room, after the sender's index
+bool cmdChat(Room *room, int player, char *arg) {
+	char msg[1 + CHAT_MAXLEN];
+	size_t len = strlen(arg) < CHAT_MAXLEN ? strlen(arg) : CHAT_MAXLEN;
+	msg[0] = player;
+	memcpy(msg + 1, arg, len);
+	for (int i = 0; i < 4; i++) {
+		if (connected(room, i)) {
+			reply(room, i, FRAME_CHAT, msg, 1 + len);
+		}
+	}
+	return false;
 }
 
-int open_listenfd(char *port) 
-{
-    struct addrinfo hints, *listp, *p;
-    int listenfd, rc, optval=1;
-
-    /* Get a list of potential server addresses */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
-    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
-    hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
-    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
-        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
-        return -2;
-    }
-
-    /* Walk the list for one that we can bind to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue;  /* Socket failed, try the next */
-
-        /* Eliminates "Address already in use" error from bind */
-        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
-                   (const void *)&optval , sizeof(int));
-
-        /* Bind the descriptor to the address */
-        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
-            break; /* Success */
-        if (close(listenfd) < 0) { /* Bind failed, try the next */
-            fprintf(stderr, "open_listenfd close failed: %s\n", strerror(errno));
-            return -1;
-        }
-    }
-
-
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* No address worked */
-        return -1;
-
-    /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
-        close(listenfd);
-	return -1;
-    }
-    return listenfd;
+// leave the grid but keep receiving the game
+bool cmdSpectate(Room *room, int player, char *arg) {
+	if (!room->spectating[player]) {
+		room->spectating[player] = true;
+		despawnPlayer(&room->game, player);
+		record(room, REPLAY_SPECTATE, player, 0, 0);
+		room->changed = true;
+	}
+	return false;
 }
 
-int Open_listenfd(char *port) 
-{
-    int rc;
+// snapshots and moves go as datagrams from now on, answered with where to
+bool cmdUdp(Room *room, int player, char *arg) {
+	if (room->owner->udpfd >= 0) {
+		unsigned offset = room->owner->udpPort - room->owner->tcpPort;
+		unsigned char msg[2] = {offset >> 8, offset};
+		reply(room, player, FRAME_UDP, msg, sizeof(msg));
+	}
+	return false;
+}
 
-    if ((rc = open_listenfd(port)) < 0)
-	unix_error("Open_listenfd error");
-    return rc;
+// snapshots and deltas go out packed from now on
+bool cmdCompact(Room *room, int player, char *arg) {
+	room->compact[player] = true;
+	return false;
 }
 
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
-{
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
-    }
-    *bufp = 0;
-    return n-1;
-}
-
-ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
-{
-    ssize_t rc;
+// Perfect hash of a command's first and last letters and length. A new
+// command may need new constants if it collides; the table has room to spare.
+#define CMDHASH(first, last, len) ((2 * (first) + 10 * (last) + (len)) & 15)
 
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0)
-	unix_error("Rio_readlineb error");
-    return rc;
-} 
+typedef struct {
+	const char *name;
+	size_t len;
+	CommandHandler handler;
+} Command;
+
+const Command commands[16] = {
+	[CMDHASH('q', 't', 4)] = {"quit", 4, cmdQuit},
+	[CMDHASH('u', 'p', 2)] = {"up", 2, cmdUp},
+	[CMDHASH('d', 'n', 4)] = {"down", 4, cmdDown},
+	[CMDHASH('l', 't', 4)] = {"left", 4, cmdLeft},
+	[CMDHASH('r', 't', 5)] = {"right", 5, cmdRight},
+	[CMDHASH('s', 't', 5)] = {"start", 5, cmdStart},
+	[CMDHASH('p', 'g', 4)] = {"ping", 4, cmdPing},
+	[CMDHASH('c', 't', 4)] = {"chat", 4, cmdChat},
+	[CMDHASH('s', 'e', 8)] = {"spectate", 8, cmdSpectate},
+	[CMDHASH('u', 'p', 3)] = {"udp", 3, cmdUdp},
+	[CMDHASH('c', 't', 7)] = {"compact", 7, cmdCompact},
+};
+
+bool processinput(Room *room, char* buf, int player) {
+	size_t len = strcspn(buf, " \n");
+	if (len == 0) {
+		return false;
+	}
+	const Command *cmd = &commands[CMDHASH((unsigned char) buf[0], (unsigned char) buf[len - 1], len)];
+	if (cmd->handler == NULL || cmd->len != len || memcmp(cmd->name, buf, len) != 0) {
+		return false;
+	}
+	char *arg = buf + len;
+	if (*arg == ' ') {
+		arg++;
+	}
+	arg[strcspn(arg, "\n")] = '\0';
+	return cmd->handler(room, player, arg);
+}
 
-void Fputs(const char *ptr, FILE *stream) 
-{
-    if (fputs(ptr, stream) == EOF)
-	unix_error("Fputs error");
+void queueAck(FrameQueue *q, unsigned last, unsigned tick) {
+	unsigned char ack[8] = {last >> 24, last >> 16, last >> 8, last,
+				tick >> 24, tick >> 16, tick >> 8, tick};
+	queueFrame(q, FRAME_ACK, ack, sizeof(ack));
 }
 
-char *Fgets(char *ptr, int n, FILE *stream) 
-{
-    char *rptr;
+// The whole snapshot, shared by every player it goes to
+void queueSnapshot(FrameQueue *q, const Snapshot *snap, bool compact) {
+	if (compact) {
+		queueFrameRef(q, FRAME_PACKED, snap->packed, snap->packedLen);
+	}
+	else {
+		queueFrameRef(q, FRAME_SNAPSHOT, snap->text, snap->len);
+	}
+}
 
-    if (((rptr = fgets(ptr, n, stream)) == NULL) && ferror(stream))
-	app_error("Fgets error");
+// Only what changed since snapshot from, if it is still in the history;
+// false if it isn't or the full snapshot is smaller
+bool queueDelta(FrameQueue *q, Room *room, unsigned from, const Snapshot *snap, bool compact) {
+	const Snapshot *base = &room->history[from % HISTORY_LEN];
+	unsigned age = snap->tick - from;
+	if (age == 0 || age >= HISTORY_LEN || base->tick != from || base->len == 0) {
+		return false;
+	}
+	unsigned char delta[4 + SNAPSHOT_MAXLEN + PACK_MAXLEN] = {from >> 24, from >> 16, from >> 8, from};
+	int n = compact ? packSnapshot(&snap->game, &base->game, false, delta + 4)
+			: encodeDelta(base->text, snap->text, snap->len, (char *) delta + 4);
+	if (n < 0 || (compact && n >= snap->packedLen)) {
+		return false;
+	}
+	queueFrame(q, compact ? FRAME_PACKED_DELTA : FRAME_DELTA, delta, 4 + n);
+	return true;
+}
 
-    return rptr;
+// An ack and the snapshot, or a delta from the newest one the player has, in
+// one datagram. A lost one is made up for by the next, or sent again when the
+// player's ack shows it is behind.
+void sendDatagram(Room *room, int player, const Snapshot *snap) {
+	FrameQueue q;
+	char dgram[UDP_MAXDGRAM];
+	initFrameQueue(&q, -1);
+	queueAck(&q, room->lastInput[player], snap->tick);
+	if (!queueDelta(&q, room, room->udpAcked[player], snap, room->compact[player])) {
+		queueSnapshot(&q, snap, room->compact[player]);
+	}
+	ssize_t n = gatherFrames(&q, dgram, sizeof(dgram));
+	if (n > 0) {
+		impairSend(impaired, room->owner->udpfd, dgram, n, (SA *) &room->udpAddr[player],
+			   room->udpAddrLen[player]);
+	}
 }
 
-void posix_error(int code, char *msg) /* Posix-style error */
-{
-    fprintf(stderr, "%s: %s\n", msg, strerror(code));
-    exit(0);
+// The ack and snapshot viewers get, as a keyframe and as a delta from the
+// previous tick, made once for all of them
+void publishSnapshot(Room *room, const Snapshot *snap) {
+	FrameQueue q;
+	char key[2 * FRAME_HEADER + 8 + PACK_MAXLEN];
+	char delta[2 * FRAME_HEADER + 12 + PACK_MAXLEN];
+	initFrameQueue(&q, -1);
+	queueAck(&q, 0, snap->tick);
+	queueSnapshot(&q, snap, true);
+	ssize_t keyLen = gatherFrames(&q, key, sizeof(key));
+	queueAck(&q, 0, snap->tick);
+	ssize_t deltaLen = -1;
+	if (queueDelta(&q, room, snap->tick - 1, snap, true)) {
+		deltaLen = gatherFrames(&q, delta, sizeof(delta));
+	}
+	clearFrames(&q);
+	if (keyLen > 0) {
+		publishFrames(room->owner->id, snap->tick, key, keyLen, deltaLen > 0 ? delta : NULL, deltaLen);
+	}
 }
 
-void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp, 
-		    void * (*routine)(void *), void *argp) 
-{
-    int rc;
+// Send the current state to every player. The snapshot is encoded once and
+// each connection gets its ack and a reference to it in a single send. Compact
+// players on TCP get it as a delta from the last one they were sent.
+void broadcast(Room *room) {
+	Snapshot *snap = &room->history[room->tick % HISTORY_LEN];
+	snap->tick = room->tick;
+	snap->len = encodeSnapshot(&room->game, snap->text);
+	snap->game = room->game;
+	snap->packedLen = packSnapshot(&room->game, NULL, packLz, snap->packed);
+	for (int j = 0; j < 4; j++) {
+		if (!connected(room, j)) {
+			continue;
+		}
+		if (room->udp[j]) {
+			sendDatagram(room, j, snap);
+			if (!room->reliable) {
+				continue;
+			}
+		}
+		// replies queued this tick go out with the update if it still fits
+		if (!framesFit(&room->queues[j], 8 + 4 + SNAPSHOT_MAXLEN, 2)) {
+			loopSend(room->owner->loop, &room->queues[j]);
+		}
+		queueAck(&room->queues[j], room->lastInput[j], room->tick);
+		if (!room->hasBase[j] || !queueDelta(&room->queues[j], room, room->baseTick[j], snap, room->compact[j])) {
+			queueSnapshot(&room->queues[j], snap, room->compact[j]);
+		}
+		// a UDP player may not have the last one it got over TCP
+		room->hasBase[j] = room->compact[j] && !room->udp[j];
+		room->baseTick[j] = room->tick;
+		loopSend(room->owner->loop, &room->queues[j]);
+	}
+	room->reliable = false;
+	if (roomViewers(room->owner->id) > 0) {
+		publishSnapshot(room, snap);
+	}
+	room->tick++;
+	// a checkpoint now and then, for replays to verify against
+	if (room->tick % REPLAY_CHECK_INTERVAL == 0) {
+		record(room, REPLAY_CHECK, 0, 0, replayChecksum(&room->game));
+	}
+}
 
-    if ((rc = pthread_create(tidp, attrp, routine, argp)) != 0)
-	posix_error(rc, "Pthread_create error");
+int playerOf(Room *room, int fd) {
+	for (int i = 0; i < 4; i++) {
+		if (room->playerNumber[i] == true && room->connections[i] == fd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Claim a place in the lowest-numbered room that isn't full, so players who
+// come one after another play together whichever shard accepted them
+Room *reserveRoom(void) {
+	for (int k = 0; k < shardCount; k++) {
+		Room *room = &rooms[k];
+		if (__atomic_fetch_add(&room->reserved, 1, __ATOMIC_ACQUIRE) < 4) {
+			return room;
+		}
+		__atomic_fetch_sub(&room->reserved, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
 }
 
+// Random apart from the room and slot it is for, which a reconnect arriving
+// at any shard needs to find them
+uint64_t newToken(Room *room, int player) {
+	uint64_t r = 0;
+	if (getrandom(&r, sizeof(r), 0) != sizeof(r)) {
+		r = ((uint64_t) rand() << 32) ^ rand() ^ msNow();
+	}
+	return (uint64_t) (room - rooms) << 56 | (uint64_t) player << 48 | (r & 0xffffffffffff);
+}
 
+void welcome(Room *room, int player) {
+	uint64_t t = room->token[player];
+	unsigned char msg[9] = {player, t >> 56, t >> 48, t >> 40, t >> 32, t >> 24, t >> 16, t >> 8, t};
+	reply(room, player, FRAME_WELCOME, msg, sizeof(msg));
+}
 
-void Sem_init(sem_t *sem, int pshared, unsigned int value) 
-{
-    if (sem_init(sem, pshared, value) < 0)
-	unix_error("Sem_init error");
+// Called on the owner's thread; the reservation guarantees a free slot
+int joinRoom(Room *room, int fd) {
+	int num = 0;
+	while (room->playerNumber[num] == true) {
+		num++;
+	}
+	room->connections[num] = fd;
+	room->token[num] = newToken(room, num);
+	initFrameQueue(&room->queues[num], fd);
+	welcome(room, num);
+	initializePlayer(room, num);
+	room->playerCount++;
+	return num;
 }
 
-void P(sem_t *sem) 
-{
-    if (sem_wait(sem) < 0)
-	unix_error("P error");
+// Take back the slot a token was given for, if it is still held
+Room *claimSlot(uint64_t token, int *player) {
+	unsigned r = token >> 56;
+	unsigned p = (token >> 48) & 0xff;
+	if (token == 0 || r >= (unsigned) shardCount || p >= 4) {
+		return NULL;
+	}
+	Room *room = &rooms[r];
+	if (!__atomic_compare_exchange_n(&room->resumable[p], &token, 0, false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	*player = p;
+	return room;
 }
 
-void V(sem_t *sem) 
-{
-    if (sem_post(sem) < 0)
-	unix_error("V error");
+// Give a dropped player its new connection. The next broadcast is a delta if
+// the client's last snapshot is still in the history.
+void resumePlayer(Room *room, int player, int fd, unsigned lastTick) {
+	room->connections[player] = fd;
+	room->inputLen[player] = 0;
+	room->udp[player] = false;
+	room->compact[player] = false;
+	initFrameQueue(&room->queues[player], fd);
+	welcome(room, player);
+	room->hasBase[player] = true;
+	room->baseTick[player] = lastTick;
+}
+
+void received(void *ctx, int fd, const char *buf, size_t len);
+
+// Called on the owner's thread with the fd watched by its loop
+void attach(Joining *j, int fd) {
+	Room *room = j->room;
+	int player = j->slot;
+	if (player >= 0) {
+		resumePlayer(room, player, fd, j->lastTick);
+	}
+	else {
+		player = joinRoom(room, fd);
+	}
+	// everyone sees the player arrive, and a resume with a stale token gets
+	// a snapshot without having to ask
+	room->changed = true;
+	room->reliable = true;
+	logEvent(LOG_INFO, EV_JOINED, j->port, room->owner->id, player, j->slot >= 0 ? "resumed" : "new");
+	received(room->owner, fd, j->buf, j->len);
+	Free(j);
 }
 
-void Pthread_detach(pthread_t tid) {
-    int rc;
+void handOff(Joining *j, int fd) {
+	Shard *owner = j->room->owner;
+	Handoff *h = Malloc(sizeof(Handoff));
+	h->fd = fd;
+	h->join = j;
+	h->next = __atomic_load_n(&owner->inbox, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->inbox, &h->next, h, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		;
+	}
+	loopWake(owner->loop);
+}
 
-    if ((rc = pthread_detach(tid)) != 0)
-	posix_error(rc, "Pthread_detach error");
+ACCEPTRESULT accepted(void *ctx, int fd, struct sockaddr_storage *clientaddr, socklen_t clientlen) {
+	char hostname[MAXLINE], port[MAXLINE];
+	// numeric only: a reverse lookup here would stall the shard on DNS
+	Getnameinfo((SA *) clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
+		    NI_NUMERICHOST | NI_NUMERICSERV);
+	logEvent(LOG_INFO, EV_ACCEPTED, atoi(port), 0, 0, hostname);
+	if (resolveNames) {
+		resolvePeer(clientaddr, clientlen);
+	}
+	// the room is picked once the client says whether it resumes
+	Joining *j = Malloc(sizeof(Joining));
+	j->port = atoi(port);
+	j->len = 0;
+	j->room = NULL;
+	j->slot = -1;
+	j->watching = false;
+	joining[fd] = j;
+	return ACCEPT_KEPT;
 }
 
-void Free(void *ptr) 
-{
-    free(ptr);
+// Collect a new connection's bytes until its first line, "resume <token>
+// <tick>", "watch [room]" or anything else for a new player, says which room
+// it is for. "rooms" is answered without picking one.
+void greet(Shard *shard, int fd, const char *buf, size_t len) {
+	Joining *j = joining[fd];
+	size_t n = len < sizeof(j->buf) - j->len ? len : sizeof(j->buf) - j->len;
+	memcpy(j->buf + j->len, buf, n);
+	j->len += n;
+	char *eol = memchr(j->buf, '\n', j->len);
+	// still waiting, or on its way to another shard
+	if (eol == NULL || j->room != NULL) {
+		return;
+	}
+
+	char line[MAXLINE];
+	size_t lineLen = eol + 1 - j->buf;
+	memcpy(line, j->buf, lineLen);
+	line[lineLen] = '\0';
+	unsigned long long token;
+	// a relay asking what there is to watch; it hangs up once answered
+	if (strcmp(line, "rooms\n") == 0) {
+		FrameQueue q;
+		unsigned char count[2] = {shardCount >> 8, shardCount};
+		initFrameQueue(&q, fd);
+		queueFrame(&q, FRAME_ROOMS, count, sizeof(count));
+		loopSend(shard->loop, &q);
+		memmove(j->buf, j->buf + lineLen, j->len - lineLen);
+		j->len -= lineLen;
+		return;
+	}
+	if (strncmp(line, "watch", 5) == 0 && (line[5] == ' ' || line[5] == '\n')) {
+		int watched = atoi(line + 5);
+		if (watched < 0 || watched >= shardCount) {
+			logEvent(LOG_INFO, EV_REFUSED, j->port, 0, 0, "no such room");
+			loopClose(shard->loop, fd);
+			return;
+		}
+		j->room = &rooms[watched];
+		j->watching = true;
+		loopRelease(shard->loop, fd);
+		return;
+	}
+	// a relay has no game to join
+	if (relayHost != NULL) {
+		logEvent(LOG_INFO, EV_REFUSED, j->port, 0, 0, "a relay only takes viewers");
+		loopClose(shard->loop, fd);
+		return;
+	}
+	if (sscanf(line, "resume %llx %u", &token, &j->lastTick) == 2) {
+		memmove(j->buf, j->buf + lineLen, j->len - lineLen);
+		j->len -= lineLen;
+		j->room = claimSlot(token, &j->slot);
+	}
+	// a new player, also when the token has expired
+	if (j->room == NULL) {
+		j->room = reserveRoom();
+	}
+	// every room is full
+	if (j->room == NULL) {
+		logEvent(LOG_INFO, EV_REFUSED, j->port, 0, 0, NULL);
+		loopClose(shard->loop, fd);
+		return;
+	}
+	if (j->room->owner != shard) {
+		loopRelease(shard->loop, fd);
+		return;
+	}
+	joining[fd] = NULL;
+	attach(j, fd);
 }
 
-void *Malloc(size_t size) 
-{
-    void *p;
+// The loop let go of a connection for another shard's room, or of a viewer
+void released(void *ctx, int fd) {
+	Joining *j = joining[fd];
+	joining[fd] = NULL;
+	if (j->watching) {
+		Room *room = j->room;
+		logEvent(LOG_INFO, EV_WATCHING, j->port, room->owner->id, 0, NULL);
+		watchRoom(fd, room->owner->id);
+		// a quiet room publishes its state for the newcomer
+		loopWake(room->owner->loop);
+		Free(j);
+		return;
+	}
+	handOff(j, fd);
+}
 
-    if ((p  = malloc(size)) == NULL)
-	unix_error("Malloc error");
-    return p;
+// Take in the connections other shards accepted for our room
+void woken(void *ctx) {
+	Shard *shard = ctx;
+	Handoff *h = __atomic_exchange_n(&shard->inbox, NULL, __ATOMIC_ACQUIRE);
+	// the stack is newest first, join in arrival order
+	Handoff *ordered = NULL;
+	while (h != NULL) {
+		Handoff *next = h->next;
+		h->next = ordered;
+		ordered = h;
+		h = next;
+	}
+	while (ordered != NULL) {
+		Handoff *next = ordered->next;
+		loopAdopt(shard->loop, ordered->fd);
+		attach(ordered->join, ordered->fd);
+		Free(ordered);
+		ordered = next;
+	}
 }
 
-// GAME CODE
-typedef struct
-{
-    int x;
-    int y;
-} Position;
+// Apply every complete line; all of them go out in the tick's one broadcast
+void received(void *ctx, int fd, const char *buf, size_t len) {
+	if (joining[fd] != NULL) {
+		greet(ctx, fd, buf, len);
+		return;
+	}
+	Room *room = ((Shard *) ctx)->room;
+	int player = playerOf(room, fd);
+	if (player < 0) {
+		return;
+	}
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (room->inputLen[player] < MAXLINE - 1) {
+			room->input[player][room->inputLen[player]++] = c;
+		}
+		if (c != '\n') {
+			continue;
+		}
+		room->input[player][room->inputLen[player]] = '\0';
+		room->inputLen[player] = 0;
+		if (processinput(room, room->input[player], player)) {
+			room->leaving[player] = true;
+			loopClose(room->owner->loop, fd);
+			return;
+		}
+	}
+}
 
-typedef enum
-{
-    TILE_GRASS,
-    TILE_TOMATO
-} TILETYPE;
-
-TILETYPE grid[GRIDSIZE][GRIDSIZE];
-
-Position playerPosition[4];
-int score;
-int level;
-int numTomatoes;
-int playerCount;
-int num;
-bool playerNumber[4];
-int connections[4];
-sem_t mutex;
-
-void printGrid() {
-	printf("GRID\n");
-	for (int i = 0; i < GRIDSIZE; i++) {
-		for (int j = 0; j < GRIDSIZE; j++) {
-				if (i == playerPosition[0].x && j == playerPosition[0].y) {
-					printf("P");
-				}
-				else if (i == playerPosition[1].x && j == playerPosition[1].y) {
-					printf("A");
-				}
-				else if (i == playerPosition[2].x && j == playerPosition[2].y) {
-					printf("B");
-				}
-				else if (i == playerPosition[3].x && j == playerPosition[3].y) {
-					printf("C");
-				}
-				else if (grid[i][j] == TILE_TOMATO) {
-					printf("T");
-				}
-				else if (grid[i][j] == TILE_GRASS) {
-					printf("G");
-				}
+uint32_t get32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Datagrams from UDP players, big endian: the token (8 bytes), the newest
+// tick they have (4), the sequence number of the first move (4), the number
+// of moves (1) and one DIRECTION byte per move. The moves are every one not
+// acknowledged yet, so a lost datagram is made up for by the next.
+void readable(void *ctx, int fd) {
+	Shard *shard = ctx;
+	Room *room = shard->room;
+	unsigned char buf[UDP_MAXDGRAM];
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	ssize_t n;
+	while ((n = recvfrom(fd, buf, sizeof(buf), 0, (SA *) &addr, &addrlen)) >= 0) {
+		if (n < 17) {
+			addrlen = sizeof(addr);
+			continue;
+		}
+		uint64_t token = (uint64_t) get32(buf) << 32 | get32(buf + 4);
+		unsigned player = (token >> 48) & 0xff;
+		if (token >> 56 != (unsigned) shard->id || player >= 4 ||
+		    !connected(room, player) || room->token[player] != token) {
+			addrlen = sizeof(addr);
+			continue;
+		}
+		// the newest datagram has the player's address, should it change
+		memcpy(&room->udpAddr[player], &addr, addrlen);
+		room->udpAddrLen[player] = addrlen;
+		room->udp[player] = true;
+		unsigned acked = get32(buf + 8);
+		if ((int) (acked - room->udpAcked[player]) > 0) {
+			room->udpAcked[player] = acked;
+		}
+		unsigned seq = get32(buf + 12);
+		for (int i = 0; i < buf[16] && 17 + i < n; i++) {
+			if (buf[17 + i] >= DIR_UP && buf[17 + i] <= DIR_RIGHT) {
+				sequencedMove(room, player, seq + i, buf[17 + i]);
 			}
-		printf("\n");
 		}
+		// behind, and no broadcast coming this tick to catch it up
+		if (!room->changed && room->tick > 0 && room->udpAcked[player] != room->tick - 1) {
+			sendDatagram(room, player, &room->history[(room->tick - 1) % HISTORY_LEN]);
+		}
+		addrlen = sizeof(addr);
+	}
 }
 
-// get a random value in the range [0, 1]
-double rand01()
-{
-    return (double) rand() / (double) RAND_MAX;
+// A player that didn't quit keeps its slot for RESUME_GRACE
+void closed(void *ctx, int fd) {
+	if (joining[fd] != NULL) {
+		Free(joining[fd]);
+		joining[fd] = NULL;
+		return;
+	}
+	Room *room = ((Shard *) ctx)->room;
+	int player = playerOf(room, fd);
+	if (player < 0) {
+		return;
+	}
+	logEvent(LOG_INFO, EV_CLOSED, ((Shard *) ctx)->id, player, 0, NULL);
+	if (room->leaving[player]) {
+		removePlayer(room, player);
+		room->changed = true;
+		return;
+	}
+	room->connections[player] = -1;
+	clearFrames(&room->queues[player]);
+	room->droppedAt[player] = msNow();
+	__atomic_store_n(&room->resumable[player], room->token[player], __ATOMIC_RELEASE);
 }
 
-void initGrid()
-{
-    for (int i = 0; i < GRIDSIZE; i++) {
-        for (int j = 0; j < GRIDSIZE; j++) {
-            double r = rand01();
-            if (r < 0.1) {
-                grid[i][j] = TILE_TOMATO;
-                numTomatoes++;
-            }
-            else
-                grid[i][j] = TILE_GRASS;
-        }
-    }
-    
-    for (int i = 0; i < 4; i++) {
-    	int a = playerPosition[i].x;
-    	int b = playerPosition[i].y;
-    	if (a < 0 || b < 0) {
-    		continue;
-    	}
-    	else {
-    		if (grid[a][b] == TILE_TOMATO) {
-    			grid[a][b] = TILE_GRASS;
-    			numTomatoes--;
-    		}
-    	}
-    }
-
-    // ensure grid isn't empty
-    while (numTomatoes == 0)
-        initGrid();
-}
-
-void moveTo(int x, int y, int player)
-{
-	P(&mutex);
-    // Prevent falling off the grid
-    if (x < 0 || x >= GRIDSIZE || y < 0 || y >= GRIDSIZE) {
-    V(&mutex);
-        return;
-        }
-
-    // Sanity check: player can only move to 4 adjacent squares
-    if (!(abs(playerPosition[player].x - x) == 1 && abs(playerPosition[player].y - y) == 0) &&
-        !(abs(playerPosition[player].x - x) == 0 && abs(playerPosition[player].y - y) == 1)) {
-        fprintf(stderr, "Invalid move attempted from (%d, %d) to (%d, %d)\n", playerPosition[player].x, playerPosition[player].y, x, y);
-        V(&mutex);
-        return;
-    }
-    for (int i = 0; i < 4; i++) {
-    	if (i == player) {
-    		continue;
-    	}
-    	if (x == playerPosition[i].x && y == playerPosition[i].y) {
-    		V(&mutex);
-    		return;
-    	}
-    }
-
-    playerPosition[player].x = x;
-    playerPosition[player].y = y;
-    
-    if (grid[x][y] == TILE_TOMATO) {
-        grid[x][y] = TILE_GRASS;
-        score++;
-        numTomatoes--;
-        if (numTomatoes == 0) {
-            level++;
-            initGrid();
-        }
-    }
-    V(&mutex);
-}
-
-void removePlayer(int player) {
-	playerPosition[player].x = -1;
-	playerPosition[player].y = -1;
-	playerNumber[player] = false;
-	P(&mutex);
-	playerCount--;
-	V(&mutex);
-}
-
-bool initializePlayer(int player) {
-	playerNumber[player] = true;
-	bool next = false;
-	P(&mutex);
-	for (int i = 0; i < GRIDSIZE; i++) {
-		for (int j = 0; j < GRIDSIZE; j++) {
-			if (grid[i][j] == TILE_GRASS) {
-			next = false;
-    for (int z = 0; z < 4; z++) {
-    	if (z == player) {
-    		continue;
-    	}
-    	if (i == playerPosition[z].x && j == playerPosition[z].y) {
-    		next = true;
-    		break;
-    	}
-    }
-    if (next) {
-    	continue;
-    }
-				playerPosition[player].x = i;
-				playerPosition[player].y = j;
-				V(&mutex);
-				return true;
-			}
+// Free the slots of dropped players that didn't come back in time. A failed
+// claim means a reconnect is on its way to the room.
+void expireDropped(Room *room) {
+	for (int i = 0; i < 4; i++) {
+		uint64_t token = room->token[i];
+		if (room->playerNumber[i] == true && room->connections[i] < 0 &&
+		    msNow() - room->droppedAt[i] >= RESUME_GRACE &&
+		    __atomic_compare_exchange_n(&room->resumable[i], &token, 0, false, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			removePlayer(room, i);
+			room->changed = true;
 		}
 	}
-	V(&mutex);
-	return false;
 }
 
-bool processinput(char* buf, int player) {
-	if (strcmp(buf, "quit\n") == 0) {
-		return true;
+void tick(void *ctx) {
+	Shard *shard = ctx;
+	Room *room = shard->room;
+	if (relayHost == NULL && viewerWaiting(shard->id)) {
+		room->changed = true;
 	}
-	if (strcmp(buf, "up\n") == 0) {
-		moveTo(playerPosition[player].x, playerPosition[player].y - 1, player);
+	if (room->changed) {
+		broadcast(room);
+		room->changed = false;
+		room->unsaved = true;
 	}
-	if (strcmp(buf, "down\n") == 0) {
-		moveTo(playerPosition[player].x, playerPosition[player].y + 1, player);
+	expireDropped(room);
+	impairFlush(impaired);
+	// hand a copy to the saver; if it is still busy, try again next tick
+	if (stateDir != NULL && room->unsaved && msNow() - room->lastSave >= SAVE_INTERVAL &&
+	    saveRoom(shard->id, &room->game, room->tick)) {
+		room->unsaved = false;
+		room->lastSave = msNow();
 	}
-	if (strcmp(buf, "left\n") == 0) {
-		moveTo(playerPosition[player].x - 1, playerPosition[player].y, player);
+	// replies and chat queued outside a broadcast
+	for (int i = 0; i < 4; i++) {
+		if (connected(room, i) && room->queues[i].pending > 0) {
+			loopSend(room->owner->loop, &room->queues[i]);
+		}
 	}
-	if (strcmp(buf, "right\n") == 0) {
-		moveTo(playerPosition[player].x + 1, playerPosition[player].y, player);
+}
+
+void *runShard(void *vargp) {
+	Shard *shard = vargp;
+	// keep each shard on its own core
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->id % sysconf(_SC_NPROCESSORS_ONLN) % CPU_SETSIZE, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	loopRun(shard->loop);
+	return NULL;
+}
+
+void stop(int sig) {
+	for (int i = 0; i < shardCount; i++) {
+		loopStop(shards[i].loop);
 	}
-	return false;
 }
 
-void update(int connfd, char *buf, int player) {
-	char s[10];
-		memset(buf, 0, MAXLINE);
-		for (int i = 0; i < GRIDSIZE; i++) {
-			for (int j = 0; j < GRIDSIZE; j++) {
-				if (i == playerPosition[0].x && j == playerPosition[0].y) {
-					strcat(buf, "P");
-				}
-				else if (i == playerPosition[1].x && j == playerPosition[1].y) {
-					strcat(buf, "A");
-				}
-				else if (i == playerPosition[2].x && j == playerPosition[2].y) {
-					strcat(buf, "B");
-				}
-				else if (i == playerPosition[3].x && j == playerPosition[3].y) {
-					strcat(buf, "C");
-				}
-				else if (grid[i][j] == TILE_TOMATO) {
-					strcat(buf, "T");
-				}
-				else if (grid[i][j] == TILE_GRASS) {
-					strcat(buf, "G");
-				}
-			}
+int main(int argc, char **argv) {
+	// writes to clients that disconnected fail with EPIPE instead of killing us
+	signal(SIGPIPE, SIG_IGN);
+	BACKEND backend = BACKEND_EPOLL;
+	int opt;
+
+	shardCount = sysconf(_SC_NPROCESSORS_ONLN);
+	LOGLEVEL level = LOG_INFO;
+	while ((opt = getopt(argc, argv, "b:s:nl:r:S:uI:zR:")) != -1) {
+		if (opt == 'b' && strcmp(optarg, "epoll") == 0) {
+			backend = BACKEND_EPOLL;
 		}
-		// add score, level at back, playerposition at back
-		memset(s, 0, 10);
-		sprintf(s, "%d", score+10000);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", level+10000);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[0].x + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[0].y + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[1].x + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[1].y + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[2].x + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[2].y + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[3].x + 20);
-		strcat(buf, s);
-		memset(s, 0, 10);
-		sprintf(s, "%d", playerPosition[3].y + 20);
-		strcat(buf, s);
-		
-		strcat(buf, "\n");
-		Rio_writen(connfd, buf, strlen(buf));
-}
-
-void *updateGame(void *vargp) {
-	int connfd = *((int*)vargp);
-	Pthread_detach(pthread_self());
-	Free(vargp);
-	int player = num;
-	P(&mutex);
-	num++;
-	V(&mutex);
-	int i = 0;
-	int j = 0;
-	size_t n;
-	char buf[MAXLINE], s[10];
-	rio_t rio;
-	Rio_readinitb(&rio, connfd);
-	// Give initial game state
-	Rio_readlineb(&rio, buf, MAXLINE);
-	P(&mutex);
-		while (i < playerCount) {
-			if (playerNumber[j] == true) {
-				update(connections[j], buf, j);
-				i++;
-			}
-			j++;
+		else if (opt == 'b' && strcmp(optarg, "uring") == 0) {
+			backend = BACKEND_URING;
+		}
+		else if (opt == 's' && atoi(optarg) > 0) {
+			shardCount = atoi(optarg);
+		}
+		else if (opt == 'n') {
+			resolveNames = true;
 		}
-		V(&mutex);
-	while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-		if(processinput(buf, player)) {
+		else if (opt == 'r') {
+			recordDir = optarg;
+		}
+		else if (opt == 'S') {
+			stateDir = optarg;
+		}
+		else if (opt == 'u') {
+			useUdp = true;
+		}
+		else if (opt == 'I' && initImpair(&impair, optarg)) {
+			impaired = &impair;
+		}
+		else if (opt == 'z') {
+			packLz = true;
+		}
+		else if (opt == 'R' && strrchr(optarg, ':') != NULL) {
+			relayHost = optarg;
+			relayPort = strrchr(optarg, ':') + 1;
+			relayPort[-1] = '\0';
+		}
+		else if (opt == 'l' && optarg[0] != '\0' && strchr("diwe", optarg[0]) != NULL) {
+			level = strchr("diwe", optarg[0]) - "diwe";
+		}
+		else {
+			optind = argc;
 			break;
 		}
-		i = 0;
-		j = 0;
-		P(&mutex);
-		while (i < playerCount) {
-			if (playerNumber[j] == true) {
-				update(connections[j], buf, j);
-				i++;
-			}
-			j++;
-		}
-		V(&mutex);
-	}
-		removePlayer(player);
-		printf("Closing connection\n");
-		i = 0;
-		j = 0;
-		P(&mutex);
-		while (i < playerCount) {
-			if (playerNumber[j] == true) {
-				update(connections[j], buf, j);
-				i++;
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, "usage: %s [-b epoll|uring] [-s shards] [-n] [-l debug|info|warn|error] [-r replay_dir] [-S state_dir] [-u] [-I impairment] [-z] [-R host:port] <port>\n", argv[0]);
+		exit(1);
+	}
+	if (relayHost != NULL && (recordDir != NULL || stateDir != NULL || useUdp)) {
+		fprintf(stderr, "a relay plays no game of its own, -r, -S and -u don't apply\n");
+		exit(1);
+	}
+	// a relay has a room, and so a shard, for each of the upstream's
+	if (relayHost != NULL) {
+		shardCount = upstreamRooms(relayHost, relayPort);
+		printf("Relaying %d rooms of %s:%s\n", shardCount, relayHost, relayPort);
+	}
+
+	initLog(level);
+	if (stateDir != NULL) {
+		initSaver(stateDir, shardCount);
+	}
+	if (resolveNames) {
+		initResolver(RESOLVER_THREADS);
+	}
+
+	// a connection per viewer, as many as we may open
+	struct rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	// one room per shard, each bound to the port on its own socket
+	LoopHandlers handlers = {accepted, received, closed, woken, tick, released, readable};
+	rooms = Malloc(shardCount * sizeof(Room));
+	shards = Malloc(shardCount * sizeof(Shard));
+	memset(rooms, 0, shardCount * sizeof(Room));
+	memset(shards, 0, shardCount * sizeof(Shard));
+	for (int i = 0; i < shardCount; i++) {
+		Shard *shard = &shards[i];
+		shard->id = i;
+		shard->room = &rooms[i];
+		rooms[i].owner = shard;
+		initGame(&rooms[i].game, time(NULL) + i);
+		RoomImage image;
+		if (stateDir != NULL && loadRoomImage(stateDir, i, &image)) {
+			// tokens don't survive a restart, players reconnect as new joins
+			rooms[i].game = image.game;
+			for (int j = 0; j < 4; j++) {
+				despawnPlayer(&rooms[i].game, j);
 			}
-			j++;
+			rooms[i].tick = image.tick;
+			printf("Restored room %d: level %d, score %d, saved %lds ago\n", i, image.game.level,
+			       image.game.score, (long) (time(NULL) - image.saved));
 		}
-		V(&mutex);
-		Close(connfd);
-	return NULL;
-}
+		if (recordDir != NULL) {
+			startRecording(&rooms[i], i);
+		}
+		shard->listenfd = Open_sharedlistenfd(argv[optind]);
+		shard->loop = loopCreate(backend, shard->listenfd, &handlers, shard);
+		if (shard->loop == NULL && backend == BACKEND_URING) {
+			fprintf(stderr, "io_uring not available, using epoll\n");
+			backend = BACKEND_EPOLL;
+			shard->loop = loopCreate(backend, shard->listenfd, &handlers, shard);
+		}
+		if (shard->loop == NULL) {
+			unix_error("loopCreate error");
+		}
+		shard->udpfd = -1;
+		if (useUdp) {
+			char udpPort[16];
+			shard->tcpPort = atoi(argv[optind]);
+			shard->udpPort = shard->tcpPort + 1 + i;
+			snprintf(udpPort, sizeof(udpPort), "%d", shard->udpPort);
+			shard->udpfd = Open_datagramfd(udpPort);
+			fcntl(shard->udpfd, F_SETFL, fcntl(shard->udpfd, F_GETFL) | O_NONBLOCK);
+			loopWatch(shard->loop, shard->udpfd);
+		}
+		// so a room that goes quiet still gets its last image saved and
+		// its dropped players expired, and held datagrams go out in time
+		loopSetTimer(shard->loop, impaired != NULL ? IMPAIR_TICK : SAVE_INTERVAL);
+	}
 
-int main(int argc, char **argv) {
-	// initialize the map
-	Sem_init(&mutex,0,1);
-	num = 0;
-	srand(time(NULL));
-	pthread_t tid;
-	level = 1;
-	playerCount = 0;
-	removePlayer(0);
-	removePlayer(1);
-	removePlayer(2);
-	removePlayer(3);
-	playerCount = 0;
-	initGrid();
-	// accept connections
-	int listenfd, *connfdp;
-	char hostname[MAXLINE], port[MAXLINE];
-	socklen_t clientlen;
-	struct sockaddr_storage clientaddr; // enough room for any address
-	
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
+	initFanout(shardCount);
+	if (relayHost != NULL) {
+		initRelay(relayHost, relayPort, shardCount, packLz);
 	}
-	listenfd = Open_listenfd(argv[1]);
+
+	// print the loops' statistics on the way out
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
 	// playing the game
-	while (1) {
-		while (playerCount >= 4) {
-			;
-		}
-		clientlen = sizeof(clientaddr);
-		connfdp = Malloc(sizeof(int));
-		*connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-		Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-		for (int i = 0; i < 4; i++) {
-			if (playerNumber[i] == false) {
-				num = i;
-				break;
+	for (int i = 0; i < shardCount; i++) {
+		Pthread_create(&shards[i].tid, NULL, runShard, &shards[i]);
+	}
+	for (int i = 0; i < shardCount; i++) {
+		pthread_join(shards[i].tid, NULL);
+	}
+	flushLog();
+	stopFanout();
+	printFanoutStats(stderr);
+	for (int i = 0; i < shardCount; i++) {
+		if (rooms[i].recording) {
+			record(&rooms[i], REPLAY_CHECK, 0, 0, replayChecksum(&rooms[i].game));
+			if (!closeReplayWriter(&rooms[i].replay)) {
+				fprintf(stderr, "cannot finish room %d's log: %s\n", i, strerror(errno));
 			}
 		}
-		connections[num] = *((int*)connfdp);
-		initializePlayer(num);
-		printf("Accepted connection from (%s, %s)\n", hostname, port);
-		Pthread_create(&tid, NULL, updateGame, connfdp);
-		P(&mutex);
-		playerCount++;
-		V(&mutex);
+		if (stateDir != NULL && !writeRoomImage(i, &rooms[i].game, rooms[i].tick)) {
+			fprintf(stderr, "cannot save room %d: %s\n", i, strerror(errno));
+		}
+		fprintf(stderr, "shard %d ", i);
+		printLoopStats(shards[i].loop, stderr);
 	}
+	return 0;
 }